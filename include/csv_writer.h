@@ -0,0 +1,303 @@
+// CSV Writer
+// Copyright (C) 2026 S.Fuchita (soramimi_jp)
+// This software is distributed under the MIT license.
+
+#ifndef CSV_WRITER_H
+#define CSV_WRITER_H
+
+#include "strformat.h"
+
+namespace strformat_ns {
+
+/**
+ * @brief Buffered CSV/TSV writer with typed columns.
+ *
+ * Each column is a format string such as "%d", "%08.3f" or "%-10s" and is
+ * rendered with the string_formatter conversions.  A field that contains the
+ * delimiter, a double quote or a line break is quoted as in RFC 4180.  Rows
+ * are collected in one reusable buffer and written to the sink in large
+ * chunks.
+ *
+ * @code
+ * csv_writer csv(stdout);
+ * csv.columns({"%d", "%s", "%.3f"});
+ * csv.header({"id", "name", "score"});
+ * csv.row(1, "alice", 0.5).row(2, "bob, jr.", 0.25);
+ * @endcode
+ */
+class csv_writer {
+private:
+	struct Column {
+		std::string text;
+		format_spec spec;
+		bool direct;	// text is a single plain spec: convert without a formatter
+	};
+	int fd_ = -1;
+	FILE *fp_ = nullptr;
+	char delimiter_;
+	std::vector<char> buf_;
+	size_t pos_ = 0;
+	size_t rows_ = 0;
+	bool ok_ = true;
+	std::vector<Column> columns_;
+	string_formatter fmt_;
+
+	void ensure(size_t n)
+	{
+		if (pos_ + n > buf_.size()) {
+			flush();
+			if (n > buf_.size()) {
+				buf_.resize(n);
+			}
+		}
+	}
+	void put(char c)
+	{
+		ensure(1);
+		buf_[pos_++] = c;
+	}
+	/**
+	 * @brief Commit the `n` bytes rendered at the write position, quoting
+	 *        them in place if needed.
+	 *
+	 * The caller must have reserved 2 * n + 2 bytes.
+	 */
+	void commit(size_t n)
+	{
+		char *p = buf_.data() + pos_;
+		if (!needs_quoting(p, n, delimiter_)) {
+			pos_ += n;
+			return;
+		}
+		size_t quotes = std::count(p, p + n, '"');
+		char *src = p + n;
+		char *dst = p + n + quotes + 2;
+		*--dst = '"';
+		while (src > p) {
+			char c = *--src;
+			*--dst = c;
+			if (c == '"') {
+				*--dst = '"';
+			}
+		}
+		*--dst = '"';
+		pos_ += n + quotes + 2;
+	}
+	void text_field(char const *p, size_t n)
+	{
+		ensure(2 * n + 2);
+		memcpy(buf_.data() + pos_, p, n);
+		commit(n);
+	}
+
+	template <typename T> static auto normalize(T const &value)
+	{
+		if constexpr (std::is_same<T, bool>::value) {
+			return int32_t(value);
+		} else if constexpr (std::is_same<T, char>::value) {
+			return value;
+		} else if constexpr (std::is_integral<T>::value && std::is_signed<T>::value) {
+			return typename std::conditional<sizeof(T) <= 4, int32_t, int64_t>::type(value);
+		} else if constexpr (std::is_integral<T>::value) {
+			return typename std::conditional<sizeof(T) <= 4, uint32_t, uint64_t>::type(value);
+		} else if constexpr (std::is_floating_point<T>::value) {
+			return double(value);
+		} else if constexpr (std::is_convertible<T const &, std::string_view>::value) {
+			return std::string_view(value);
+		} else {
+			return value;
+		}
+	}
+	template <typename T> bool direct(format_spec const &spec, T value)
+	{
+		if constexpr (std::is_integral<T>::value && sizeof(T) >= 4) {
+			bool hex = spec.conv == 'x';
+			if (!hex && spec.conv != (std::is_signed<T>::value ? 'd' : 'u')) return false;
+			if (hex && spec.upper && sizeof(T) == 8 && !std::is_signed<T>::value) return false; // string_formatter prints it in lower case
+			ensure(misc::array_bound(1, 0));
+			pos_ = misc::write_array(buf_.data() + pos_, &value, 1, {}, hex, spec.upper) - buf_.data();
+			return true;
+#ifndef STRFORMAT_NO_FP
+		} else if constexpr (std::is_same<T, double>::value) {
+			if (spec.conv != 'f') return false;
+			int precision = spec.precision < 0 ? 6 : spec.precision;
+			size_t n = misc::fixed_bound(value, precision);
+			ensure(n);
+			char *p = buf_.data() + pos_;
+			pos_ = misc::write_fixed(p, p + n, value, precision, false) - buf_.data();
+			return true;
+#endif
+		} else if constexpr (std::is_same<T, std::string_view>::value) {
+			if (spec.conv != 's' || spec.precision >= 0) return false;
+			text_field(value.data(), value.size());
+			return true;
+		} else {
+			return false;
+		}
+	}
+	template <typename T> void general(std::string_view text, T const &value)
+	{
+		fmt_.reset(0, text);
+		if constexpr (std::is_same<T, std::string_view>::value) {
+			fmt_.s_ref(value);
+		} else {
+			fmt_(value);
+		}
+		size_t n = fmt_.length();
+		ensure(2 * n + 2);
+		fmt_.render_to(buf_.data() + pos_);
+		commit(n);
+	}
+	template <typename T> void field(size_t i, T const &value)
+	{
+		if (i > 0) {
+			put(delimiter_);
+		}
+		Column const *c = i < columns_.size() ? &columns_[i] : nullptr;
+		auto v = normalize(value);
+		if (c && c->direct && direct(c->spec, v)) return;
+		general(c ? std::string_view(c->text) : std::string_view("%s"), v);
+	}
+	void field(size_t i, char const *value)
+	{
+		if (value) {
+			field(i, std::string_view(value));
+		} else if (i > 0) {
+			put(delimiter_); // null is an empty field
+		}
+	}
+	void field(size_t i, char *value)
+	{
+		field(i, (char const *)value);
+	}
+	void end_row()
+	{
+		put('\n');
+		rows_++;
+	}
+public:
+	/**
+	 * @param fd          Sink; written with write(2) on flush().
+	 * @param delimiter   ',' for CSV, '\t' for TSV.
+	 * @param buffer_size Bytes collected before a write.
+	 */
+	explicit csv_writer(int fd, char delimiter = ',', size_t buffer_size = 1 << 20)
+		: fd_(fd)
+		, delimiter_(delimiter)
+		, buf_(buffer_size)
+	{
+	}
+	explicit csv_writer(FILE *fp, char delimiter = ',', size_t buffer_size = 1 << 20)
+		: fp_(fp)
+		, delimiter_(delimiter)
+		, buf_(buffer_size)
+	{
+	}
+	csv_writer(csv_writer const &) = delete;
+	void operator = (csv_writer const &) = delete;
+	~csv_writer()
+	{
+		flush();
+	}
+
+	/**
+	 * @brief Whether `n` bytes at `p` contain the delimiter, '"', CR or LF.
+	 *
+	 * Checks 16 bytes at a time with SSE2 where available.
+	 */
+	static bool needs_quoting(char const *p, size_t n, char delimiter)
+	{
+		size_t i = 0;
+#ifdef STRFORMAT_SSE2
+		__m128i d = _mm_set1_epi8(delimiter);
+		__m128i dq = _mm_set1_epi8('"');
+		__m128i cr = _mm_set1_epi8('\r');
+		__m128i lf = _mm_set1_epi8('\n');
+		for (; i + 16 <= n; i += 16) {
+			__m128i x = _mm_loadu_si128((__m128i const *)(p + i));
+			__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, d), _mm_cmpeq_epi8(x, dq)), _mm_or_si128(_mm_cmpeq_epi8(x, cr), _mm_cmpeq_epi8(x, lf)));
+			if (_mm_movemask_epi8(m)) return true;
+		}
+#endif
+		for (; i < n; i++) {
+			char c = p[i];
+			if (c == delimiter || c == '"' || c == '\r' || c == '\n') return true;
+		}
+		return false;
+	}
+
+	/**
+	 * @brief Set the format of each column; unlisted columns use "%s".
+	 */
+	csv_writer &columns(std::initializer_list<std::string_view> specs)
+	{
+		columns_.clear();
+		for (std::string_view s : specs) {
+			Column c;
+			c.text = std::string(s);
+			char const *begin = c.text.data();
+			char const *end = begin + c.text.size();
+			char const *p = misc::find_percent(begin, end);
+			char const *next = format_spec::parse(p, end, &c.spec);
+			c.direct = p == begin && next == end && p < end
+				&& !c.spec.zero_padding && !c.spec.align_left && !c.spec.plus && !c.spec.grouping
+				&& c.spec.width < 0 && c.spec.conv != 0 && strchr("duxfs", c.spec.conv);
+			columns_.push_back(std::move(c));
+		}
+		return *this;
+	}
+	/**
+	 * @brief Write a row of literal field names.
+	 */
+	csv_writer &header(std::initializer_list<std::string_view> names)
+	{
+		size_t i = 0;
+		for (std::string_view s : names) {
+			if (i++ > 0) {
+				put(delimiter_);
+			}
+			text_field(s.data(), s.size());
+		}
+		end_row();
+		return *this;
+	}
+	/**
+	 * @brief Write one row; argument i is formatted by column i.
+	 */
+	template <typename... Args> csv_writer &row(Args const &... args)
+	{
+		size_t i = 0;
+		(field(i++, args), ...);
+		end_row();
+		return *this;
+	}
+	/**
+	 * @brief Write the buffered bytes to the sink.
+	 *
+	 * @return false if this or an earlier write failed.
+	 */
+	bool flush()
+	{
+		if (pos_ > 0) {
+			if (fd_ >= 0) {
+				ok_ = misc::write_all(fd_, buf_.data(), pos_) && ok_;
+			} else if (fp_) {
+				ok_ = fwrite(buf_.data(), 1, pos_, fp_) == pos_ && ok_;
+			}
+			pos_ = 0;
+		}
+		return ok_;
+	}
+	bool ok() const
+	{
+		return ok_;
+	}
+	size_t rows() const
+	{
+		return rows_;
+	}
+};
+
+} // namespace strformat_ns
+
+#endif // CSV_WRITER_H
@@ -7,19 +7,29 @@
 
 // #define STRFORMAT_NO_LOCALE
 // #define STRFORMAT_NO_FP
+// #define STRFORMAT_PROFILE
 
 #include <algorithm>
+#include <array>
+#include <chrono>
 #include <charconv>
+#include <cerrno>
+#include <climits>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <functional>
+#include <memory_resource>
 #include <string>
 #include <vector>
 #include <string_view>
 #include <cstddef>
+#include <type_traits>
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
 
 #ifndef STRFORMAT_NO_LOCALE
 #include <locale.h>
@@ -31,8 +41,60 @@
 #include <unistd.h>
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define STRFORMAT_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(STRFORMAT_SSE2) && (defined(__SSSE3__) || defined(__AVX__))
+#define STRFORMAT_SSSE3
+#include <tmmintrin.h>
+#endif
+
+#ifdef __SIZEOF_INT128__
+#define STRFORMAT_INT128
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <atomic>
+
+#ifdef STRFORMAT_PROFILE
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define STRFORMAT_PROFILE_RDTSC
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#else
+#include <time.h>
+#endif
+#endif
+
 namespace strformat_ns {
 
+#ifdef STRFORMAT_INT128
+__extension__ typedef __int128 int128_t;
+__extension__ typedef unsigned __int128 uint128_t;
+#endif
+
+/*
+ * Allocator policies for basic_string_formatter.
+ *
+ * A policy provides:
+ *   void *alloc(size_t size)  memory aligned for std::max_align_t, or nullptr
+ *   void free(void *ptr)      release one block (may be a no-op)
+ *   void rewind()             called by reset() after every block was freed
+ *   size_t reserved() const   heap bytes retained, for memory_usage()
+ *   void take(Policy &other)  adopt the blocks of `other` that can change owner
+ *   bool is_inline(void const *ptr) const
+ *                             true if ptr lives inside the policy object itself;
+ *                             such blocks are copied when a formatter is moved
+ */
+
 class StdAlloc {
 public:
 	void *alloc(size_t size)
@@ -43,11 +105,28 @@ public:
 	{
 		::free(ptr);
 	}
+	void rewind()
+	{
+	}
+	size_t reserved() const
+	{
+		return 0;
+	}
+	void take(StdAlloc &other)
+	{
+		(void)other;
+	}
+	bool is_inline(void const *ptr) const
+	{
+		(void)ptr;
+		return false;
+	}
 };
 
 class QuickAlloc {
 private:
 	constexpr static size_t default_buffer_size = 256;
+	constexpr static size_t max_chunk_size = 1024 * 1024;
 	constexpr static size_t alignment = alignof(std::max_align_t);
 	struct Header {
 		Header *next = nullptr;
@@ -55,6 +134,7 @@ private:
 		size_t allocated = 0;
 	};
 	alignas(std::max_align_t) char default_buffer[default_buffer_size];
+	Header *current_;	// chunk being filled; chunks before it are full
 	void *x_alloc(size_t size)
 	{
 		return ::malloc(size);
@@ -67,6 +147,10 @@ private:
 	{
 		return (n + alignment - 1) & ~(alignment - 1);
 	}
+	Header *head() const
+	{
+		return (Header *)default_buffer;
+	}
 public:
 	QuickAlloc(const QuickAlloc &) = delete;
 	QuickAlloc &operator=(const QuickAlloc &) = delete;
@@ -74,14 +158,14 @@ public:
 	QuickAlloc &operator=(QuickAlloc &&) = delete;
 	QuickAlloc()
 	{
-		Header *h = (Header *)default_buffer;
+		Header *h = head();
 		*h = {};
 		h->capacity = sizeof(default_buffer) - sizeof(Header);
+		current_ = h;
 	}
 	~QuickAlloc()
 	{
-		Header *h = (Header *)default_buffer;
-		Header *next = h->next;
+		Header *next = head()->next;
 		while (next) {
 			void *p = next;
 			next = next->next;
@@ -92,164 +176,1368 @@ public:
 	{
 		if (size == 0) size = 1;
 		size = align_up(size);
-		Header *h = (Header *)default_buffer;
-		auto Alloc = [&]()-> void * {
+		Header *h = current_;
+		while (1) {
 			if (h->allocated + size <= h->capacity) {
 				void *p = (char *)h + sizeof(Header) + h->allocated;
 				h->allocated += size;
+				current_ = h;
 				return p;
 			}
-			return nullptr;
-		};
-		void *p = Alloc();
-		if (p) return p;
-		if (h->next) {
-			h = h->next;
-			p = Alloc();
-			if (p) return p;
-		}
-		h = (Header *)default_buffer;
-		size_t bufsize = sizeof(Header) + size;
-		if (bufsize < default_buffer_size) {
-			bufsize = default_buffer_size;
-		} else if (h->next) {
+			if (!h->next) break;
 			h = h->next;
 		}
+		// append a chunk, doubling the size of the last one
+		size_t bufsize = std::min(2 * (sizeof(Header) + h->capacity), max_chunk_size);
+		bufsize = std::max(bufsize, sizeof(Header) + size);
 		Header *next = (Header *)x_alloc(bufsize);
 		*next = {};
 		next->capacity = bufsize - sizeof(Header);
-		next->next = h->next;
+		next->allocated = size;
 		h->next = next;
-		h = next;
-		return Alloc();
+		current_ = next;
+		return (char *)next + sizeof(Header);
 	}
 	void free(void *p)
 	{
 		(void)p;
-		// nop: free all at destructor
+		// nop: free all at destructor, or reuse after rewind()
+	}
+	/**
+	 * @brief Make all memory available again, keeping the chunks.
+	 *
+	 * Every pointer returned so far becomes invalid.  A formatter that is
+	 * reused with reset() therefore stops allocating once its chunks are
+	 * large enough for the workload.
+	 */
+	void rewind()
+	{
+		for (Header *h = head(); h; h = h->next) {
+			h->allocated = 0;
+		}
+		current_ = head();
+	}
+	/**
+	 * @brief Total bytes of heap chunks held.
+	 */
+	size_t reserved() const
+	{
+		size_t n = 0;
+		for (Header *h = head()->next; h; h = h->next) {
+			n += sizeof(Header) + h->capacity;
+		}
+		return n;
+	}
+	/**
+	 * @brief Adopt the heap chunks of `other`.
+	 *
+	 * Blocks in those chunks stay where they are and are released by this
+	 * allocator from now on.  Blocks in the inline buffer of `other` cannot
+	 * move; see is_inline().
+	 */
+	void take(QuickAlloc &other)
+	{
+		Header *h = head();
+		while (h->next) {
+			h = h->next;
+		}
+		h->next = other.head()->next;
+		other.head()->next = nullptr;
+		other.current_ = other.head();
+	}
+	bool is_inline(void const *ptr) const
+	{
+		return ptr >= (void const *)default_buffer && ptr < (void const *)(default_buffer + sizeof(default_buffer));
 	}
 };
 
-class misc {
+/**
+ * @brief Allocator backed by a std::pmr::memory_resource.
+ *
+ * Each block records its size so that it can be returned to the resource.
+ */
+class PmrAlloc {
+private:
+	struct alignas(std::max_align_t) Header {
+		size_t size;
+	};
+	std::pmr::memory_resource *mr_;
+public:
+	PmrAlloc(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+		: mr_(mr)
+	{
+	}
+	std::pmr::memory_resource *resource() const
+	{
+		return mr_;
+	}
+	void *alloc(size_t size)
+	{
+		size += sizeof(Header);
+		Header *h = (Header *)mr_->allocate(size, alignof(Header));
+		h->size = size;
+		return h + 1;
+	}
+	void free(void *ptr)
+	{
+		Header *h = (Header *)ptr - 1;
+		mr_->deallocate(h, h->size, alignof(Header));
+	}
+	void rewind()
+	{
+	}
+	size_t reserved() const
+	{
+		return 0;
+	}
+	void take(PmrAlloc &other)
+	{
+		mr_ = other.mr_;
+	}
+	bool is_inline(void const *ptr) const
+	{
+		(void)ptr;
+		return false;
+	}
+};
+
+/**
+ * @brief Allocator with a fixed inline buffer and no heap fallback.
+ *
+ * alloc() returns nullptr when the buffer is exhausted.
+ */
+template <size_t N> class FixedAlloc {
 private:
+	constexpr static size_t alignment = alignof(std::max_align_t);
+	alignas(std::max_align_t) char buffer_[N];
+	size_t allocated_ = 0;
+public:
+	constexpr static size_t capacity = N;
+	FixedAlloc() = default;
+	FixedAlloc(const FixedAlloc &) = delete;
+	FixedAlloc &operator=(const FixedAlloc &) = delete;
+	void *alloc(size_t size)
+	{
+		size = (std::max(size, (size_t)1) + alignment - 1) & ~(alignment - 1);
+		if (size > N - allocated_) return nullptr;
+		void *p = buffer_ + allocated_;
+		allocated_ += size;
+		return p;
+	}
+	void free(void *ptr)
+	{
+		(void)ptr;
+	}
+	void rewind()
+	{
+		allocated_ = 0;
+	}
+	size_t reserved() const
+	{
+		return 0;
+	}
+	void take(FixedAlloc &other)
+	{
+		(void)other;
+	}
+	bool is_inline(void const *ptr) const
+	{
+		return ptr >= (void const *)buffer_ && ptr < (void const *)(buffer_ + N);
+	}
+};
+
+/**
+ * @brief Capacity of fixed_str() for a given allocator.
+ */
+template <typename A, typename = void> struct inline_capacity {
+	constexpr static size_t value = 256;
+};
+template <typename A> struct inline_capacity<A, std::void_t<decltype(A::capacity)>> {
+	constexpr static size_t value = A::capacity;
+};
+
+class misc {
+public:
 	/**
-	 * @brief Return 10 raised to an integer power.
-	 *
-	 * A small lookup table is used for the most common range to avoid
-	 * calling the comparatively expensive `pow()` routine.  Values outside
-	 * the table range fall back to `pow(10.0, exp)`.
+	 * @brief Find the next '%' in [p, end), or return end.
 	 *
-	 * @param exp Decimal exponent (positive or negative).
-	 * @return The value 10^exp as a double.
+	 * memchr() is vectorized by every mainstream libc (SSE2/AVX2/NEON), so
+	 * long literal runs are skipped 16-64 bytes at a time.
 	 */
-	static double pow10_int(int exp)
+	static char const *find_percent(char const *p, char const *end)
 	{
-		// Pre‑computed powers for |exp| ≤ 16
-		static const double tbl[] = {
-			1e+00, 1e+01, 1e+02, 1e+03, 1e+04, 1e+05, 1e+06,
-			1e+07, 1e+08, 1e+09, 1e+10, 1e+11, 1e+12, 1e+13,
-			1e+14, 1e+15, 1e+16
-		};
-		if (exp >= 0 && exp < static_cast<int>(sizeof tbl / sizeof *tbl))
-			return tbl[exp];
-		if (exp <= 0 && exp > -static_cast<int>(sizeof tbl / sizeof *tbl))
-			return 1.0 / tbl[-exp];
-		// Rare case: delegate to libm
-		return std::pow(10.0, exp);
+		char const *r = (char const *)memchr(p, '%', end - p);
+		return r ? r : end;
 	}
-public:
 	/**
-	 * @brief Locale‑independent `strtod` clone.
+	 * @brief write(2) the whole buffer, retrying on EINTR and short writes.
 	 *
-	 * Parses a floating‑point literal from a C‑string.  Leading white‑space,
-	 * an optional sign, fractional part (with a mandatory '.' as the decimal
-	 * separator), and an optional exponent (`e`/`E`) are recognised.
+	 * Async-signal-safe.
+	 */
+	static bool write_all(int fd, char const *ptr, size_t len)
+	{
+		while (len > 0) {
+			auto n = ::write(fd, ptr, (unsigned)len);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+			ptr += n;
+			len -= n;
+		}
+		return true;
+	}
+	/**
+	 * @brief Index of the lowest set bit of a non-zero value.
+	 */
+	static int ctz32(uint32_t v)
+	{
+#ifdef _MSC_VER
+		unsigned long i;
+		_BitScanForward(&i, v);
+		return (int)i;
+#else
+		return __builtin_ctz(v);
+#endif
+	}
+	/**
+	 * @brief Number of leading zero bits; `v` must not be 0.
+	 */
+	static int clz64(uint64_t v)
+	{
+#ifdef _MSC_VER
+		unsigned long i;
+		_BitScanReverse64(&i, v);
+		return 63 - (int)i;
+#else
+		return __builtin_clzll(v);
+#endif
+	}
+	static uint64_t bswap64(uint64_t v)
+	{
+#ifdef _MSC_VER
+		return _byteswap_uint64(v);
+#else
+		return __builtin_bswap64(v);
+#endif
+	}
+	/**
+	 * @brief "00".."99", two characters per entry.
+	 */
+	static char const *digit_pairs()
+	{
+		return "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+		       "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+	}
+#ifndef STRFORMAT_NO_FP
+	/**
+	 * @brief Fixed notation with `precision` fraction digits by integer scaling.
 	 *
-	 * The implementation **ignores the current locale**; the decimal point
-	 * must be `'.'` and no thousands separators are accepted.
+	 * The exact product val * 10^precision is formed as hi + lo (TwoProduct)
+	 * and rounded half-even, so the digits match to_chars(fixed) exactly.
+	 * Only non-negative values whose scaled form is below 2^52 and precisions
+	 * up to 15 are handled; otherwise nullptr is returned and the caller
+	 * falls back to the general path.
 	 *
-	 * @param nptr   Pointer to NUL‑terminated text to parse.
-	 * @param endptr If non‑NULL, receives a pointer to the first character
-	 *               following the parsed number (or `nptr` on failure).
-	 * @return The parsed value.
+	 * @param dst Receives at most 18 characters (no NUL).
+	 * @return Pointer past the last character written, or nullptr.
 	 */
-	static double my_strtod(const char *nptr, char **endptr)
+	static char *format_fixed_small(char *dst, double val, int precision)
 	{
-		const char *s = nptr;
-		bool sign = false;
-		bool saw_digit = false;
-		int frac_digits = 0;
-		long exp_val = 0;
-		bool exp_sign = false;
-		double value = 0.0;
-
-		// Skip leading white‑space
-		while (std::isspace((unsigned char)*s)) ++s;
-
-		// Parse optional sign
-		if (*s == '+' || *s == '-') {
-			if (*s == '-') sign = true;
-			s++;
+		static const double pow10[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+			1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+		};
+		if (precision < 0 || precision > 15) return nullptr;
+		if (!(val >= 0) || std::signbit(val)) return nullptr;
+		double p = pow10[precision];
+		double hi = val * p;
+		if (!(hi < 4503599627370496.0)) return nullptr; // 2^52: ulp(hi) <= 0.5
+#ifdef FP_FAST_FMA
+		double lo = std::fma(val, p, -hi);
+#else
+		// Dekker's split
+		double c = 134217729.0 * val; // 2^27 + 1
+		double vh = c - (c - val);
+		double vl = val - vh;
+		double c2 = 134217729.0 * p;
+		double ph = c2 - (c2 - p);
+		double pl = p - ph;
+		double lo = ((vh * ph - hi) + vh * pl + vl * ph) + vl * pl;
+#endif
+		double f = std::floor(hi);
+		double t = (hi - f - 0.5) + lo; // hi - f - 0.5 is exact; adding lo keeps the sign
+		uint64_t r = (uint64_t)f;
+		if (t > 0 || (t == 0 && (r & 1))) {
+			r++;
 		}
 
-		// Integer part
-		while (std::isdigit((unsigned char)*s)) {
-			saw_digit = true;
-			value = value * 10.0 + (*s - '0');
-			s++;
+		// digits, right to left; at least one before the point
+		char tmp[24];
+		char *end = tmp + sizeof(tmp);
+		char *ptr = end;
+		char const *pairs = digit_pairs();
+		int n = precision;
+		while (n >= 2) {
+			ptr -= 2;
+			memcpy(ptr, pairs + (r % 100) * 2, 2);
+			r /= 100;
+			n -= 2;
 		}
-
-		// Fractional part
-		if (*s == '.') {
-			s++;
-			while (std::isdigit((unsigned char)*s)) {
-				saw_digit = true;
-				value = value * 10.0 + (*s - '0');
-				s++;
-				frac_digits++;
-			}
+		if (n == 1) {
+			*--ptr = char('0' + r % 10);
+			r /= 10;
 		}
-
-		// No digits at all -> conversion failure
-		if (!saw_digit) {
-			if (endptr) *endptr = const_cast<char *>(nptr);
-			return 0.0;
+		if (precision > 0) {
+			*--ptr = '.';
 		}
-
-		// Exponent part
-		if (*s == 'e' || *s == 'E') {
-			s++;
-			const char *exp_start = s;
-			if (*s == '+' || *s == '-') {
-				if (*s == '-') exp_sign = true;
-				s++;
-			}
-			if (std::isdigit((unsigned char)*s)) {
-				while (std::isdigit((unsigned char)*s)) {
-					exp_val = exp_val * 10 + (*s - '0');
-					s++;
-				}
-				if (exp_sign) {
-					exp_val = -exp_val;
-				}
-			} else {
-				// Roll back if 'e' is not followed by a valid exponent
-				s = exp_start - 1;
-			}
+		do {
+			*--ptr = char('0' + r % 10);
+			r /= 10;
+		} while (r != 0);
+		size_t len = end - ptr;
+		memcpy(dst, ptr, len);
+		return dst + len;
+	}
+#endif
+#ifdef STRFORMAT_SSE2
+	/**
+	 * @brief Digits of a value below 10^8, one per 16-bit lane.
+	 *
+	 * Splits by 10^4, then divides by 10^3..10^0 with multiply-high
+	 * (W. Mula's method, as in Milo Yip's itoa benchmark).
+	 */
+	static __m128i digits8(uint32_t value)
+	{
+		__m128i abcdefgh = _mm_cvtsi32_si128((int)value);
+		__m128i abcd = _mm_srli_epi64(_mm_mul_epu32(abcdefgh, _mm_set1_epi32((int)0xd1b71759)), 45);
+		__m128i efgh = _mm_sub_epi32(abcdefgh, _mm_mul_epu32(abcd, _mm_set1_epi32(10000)));
+		__m128i v1 = _mm_slli_epi64(_mm_unpacklo_epi16(abcd, efgh), 2);
+		__m128i v2 = _mm_unpacklo_epi16(v1, v1);
+		v2 = _mm_unpacklo_epi32(v2, v2);
+		__m128i v3 = _mm_mulhi_epu16(v2, _mm_setr_epi16(8389, 5243, 13108, -32768, 8389, 5243, 13108, -32768));
+		__m128i v4 = _mm_mulhi_epu16(v3, _mm_setr_epi16(1 << 7, 1 << 11, 1 << 13, -32768, 1 << 7, 1 << 11, 1 << 13, -32768));
+		__m128i v5 = _mm_slli_epi64(_mm_mullo_epi16(v4, _mm_set1_epi16(10)), 16);
+		return _mm_sub_epi16(v4, v5);
+	}
+	/**
+	 * @brief Digits of a value below 10^16, one per byte (not ASCII).
+	 */
+	static __m128i digits16(uint64_t value)
+	{
+		return _mm_packus_epi16(digits8(uint32_t(value / 100000000)), digits8(uint32_t(value % 100000000)));
+	}
+	/**
+	 * @brief Store the 16 bytes of `v` from byte `skip` on; writes 16 bytes.
+	 *
+	 * The leading bytes are dropped by shifting the 64-bit halves.
+	 */
+	static char *store_tail(char *dst, __m128i v, int skip)
+	{
+		alignas(16) uint64_t x[2];
+		_mm_store_si128((__m128i *)x, v);
+		if (skip < 8) {
+			uint64_t h = x[0] >> (skip * 8);
+			memcpy(dst, &h, 8);
+			memcpy(dst + 8 - skip, &x[1], 8);
+		} else {
+			uint64_t l = x[1] >> ((skip - 8) * 8);
+			memcpy(dst, &l, 8);
 		}
-
-		// Scale by 10^(exponent − #fractional‑digits)
-		int total_exp = exp_val - frac_digits;
-		if (total_exp != 0) {
-			value *= pow10_int(total_exp);
+		return dst + 16 - skip;
+	}
+#endif
+	/**
+	 * @brief Write `v` in decimal.
+	 *
+	 * May store up to 20 bytes at `dst` regardless of the digit count.
+	 * @return Pointer past the last digit.
+	 */
+	static char *write_uint64(char *dst, uint64_t v)
+	{
+#ifdef STRFORMAT_SSE2
+		if (v < 10) {
+			*dst = char('0' + v);
+			return dst + 1;
 		}
-
-		// Apply sign
-		if (sign) {
-			value = -value;
+		__m128i zero = _mm_set1_epi8('0');
+		if (v < 10000000000000000) {
+			__m128i d = v < 100000000 ? _mm_packus_epi16(_mm_setzero_si128(), digits8(uint32_t(v))) : digits16(v);
+			int skip = ctz32(~_mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_setzero_si128())));
+			return store_tail(dst, _mm_add_epi8(d, zero), skip);
 		}
-
-		// Set errno on overflow/underflow
+		dst = write_uint64(dst, v / 10000000000000000); // at most 4 digits
+		_mm_storeu_si128((__m128i *)dst, _mm_add_epi8(digits16(v % 10000000000000000), zero));
+		return dst + 16;
+#else
+		char tmp[20];
+		char *end = tmp + sizeof(tmp);
+		char *ptr = end;
+		char const *pairs = digit_pairs();
+		while (v >= 100) {
+			ptr -= 2;
+			memcpy(ptr, pairs + (v % 100) * 2, 2);
+			v /= 100;
+		}
+		if (v >= 10) {
+			ptr -= 2;
+			memcpy(ptr, pairs + v * 2, 2);
+		} else {
+			*--ptr = char('0' + v);
+		}
+		memcpy(dst, ptr, end - ptr);
+		return dst + (end - ptr);
+#endif
+	}
+#ifdef STRFORMAT_SSE2
+	/**
+	 * @brief Hex digit characters for 16 nibble values.
+	 */
+	static __m128i hex_ascii(__m128i nib, bool upper)
+	{
+		__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(nib, _mm_set1_epi8(9)), _mm_set1_epi8(upper ? 'A' - '9' - 1 : 'a' - '9' - 1));
+		return _mm_add_epi8(_mm_add_epi8(nib, _mm_set1_epi8('0')), alpha);
+	}
+#endif
+	/**
+	 * @brief Write `v` in hex without leading zeros.
+	 *
+	 * May store up to 16 bytes at `dst` regardless of the digit count.
+	 */
+	static char *write_hex64(char *dst, uint64_t v, bool upper)
+	{
+#ifdef STRFORMAT_SSE2
+		if (v < 16) {
+			*dst = (upper ? "0123456789ABCDEF" : "0123456789abcdef")[v];
+			return dst + 1;
+		}
+		uint64_t be = bswap64(v);
+		__m128i b = _mm_loadl_epi64((__m128i const *)&be);
+		__m128i m = _mm_set1_epi8(15);
+		__m128i nib = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(b, 4), m), _mm_and_si128(b, m));
+		int skip = ctz32(~_mm_movemask_epi8(_mm_cmpeq_epi8(nib, _mm_setzero_si128())));
+		return store_tail(dst, hex_ascii(nib, upper), skip);
+#else
+		char const *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+		char tmp[16];
+		char *end = tmp + sizeof(tmp);
+		char *ptr = end;
+		do {
+			*--ptr = digits[v & 15];
+			v >>= 4;
+		} while (v != 0);
+		memcpy(dst, ptr, end - ptr);
+		return dst + (end - ptr);
+#endif
+	}
+	/**
+	 * @brief Write `v` in binary, at least `min_digits` digits.
+	 *
+	 * Each byte is expanded to eight '0'/'1' characters at once: the byte
+	 * is broadcast, each lane keeps its own bit, and adding 0x7f moves any
+	 * set bit to bit 7.
+	 */
+	static char *write_bin64(char *dst, uint64_t v, int min_digits = 1)
+	{
+		auto Expand = [](uint64_t byte){
+			uint64_t t = byte * 0x0101010101010101ull;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			t &= 0x8040201008040201ull;
+#else
+			t &= 0x0102040810204080ull; // most significant bit first in memory
+#endif
+			return (((t + 0x7f7f7f7f7f7f7f7full) >> 7) & 0x0101010101010101ull) | 0x3030303030303030ull;
+		};
+		int n = std::max(v == 0 ? 1 : 64 - clz64(v), std::min(min_digits, 64));
+		int head = (n - 1) % 8 + 1; // digits of the leading byte
+		char tmp[8];
+		uint64_t t = Expand((v >> (n - head)) & 0xff);
+		memcpy(tmp, &t, 8);
+		memcpy(dst, tmp + 8 - head, head);
+		dst += head;
+		for (int shift = n - head - 8; shift >= 0; shift -= 8) {
+			t = Expand((v >> shift) & 0xff);
+			memcpy(dst, &t, 8);
+			dst += 8;
+		}
+		return dst;
+	}
+#ifdef STRFORMAT_INT128
+	/**
+	 * @brief Write `v` in decimal.
+	 *
+	 * The value is split into 19-digit chunks, so at most two 128-bit
+	 * divisions are made.  May store up to 20 bytes past the last digit.
+	 */
+	static char *write_uint128(char *dst, uint128_t v)
+	{
+		uint64_t const e18 = 1000000000000000000ull;
+		uint64_t const e19 = 10000000000000000000ull;
+		uint64_t chunks[2];
+		int n = 0;
+		while (v >> 64 != 0) {
+			uint128_t q = v / e19;
+			chunks[n++] = uint64_t(v - q * e19);
+			v = q;
+		}
+		dst = write_uint64(dst, uint64_t(v));
+		while (n > 0) {
+			uint64_t c = chunks[--n];
+			write_uint64(dst, c % e18 + e18); // '1' and the low 18 digits
+			dst[0] = char('0' + c / e18);
+			dst += 19;
+		}
+		return dst;
+	}
+	/**
+	 * @brief Write `v` in hex without leading zeros.
+	 *
+	 * May store up to 16 bytes past the last digit.
+	 */
+	static char *write_hex128(char *dst, uint128_t v, bool upper)
+	{
+		uint64_t hi = uint64_t(v >> 64);
+		if (hi == 0) {
+			return write_hex64(dst, uint64_t(v), upper);
+		}
+		dst = write_hex64(dst, hi, upper);
+		uint64_t be = bswap64(uint64_t(v));
+		return write_hex_bytes(dst, &be, 8, upper);
+	}
+#endif
+	/**
+	 * @brief Write `n` bytes as 2 * n hex digits, high nibble first.
+	 *
+	 * With `group` > 0, `separator` is inserted after every `group` bytes
+	 * except the last.  Without grouping, 16 bytes are converted at a time
+	 * with SSE2.
+	 *
+	 * @param dst Must hold 3 * n bytes.
+	 */
+	static char *write_hex_bytes(char *dst, void const *data, size_t n, bool upper, size_t group = 0, char separator = ' ')
+	{
+		uint8_t const *src = (uint8_t const *)data;
+		char const *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+		if (group > 0 && group < n) {
+			for (size_t i = 0; i < n; i += group) {
+				if (i > 0) {
+					*dst++ = separator;
+				}
+				dst = write_hex_bytes(dst, src + i, std::min(group, n - i), upper);
+			}
+			return dst;
+		}
+		size_t i = 0;
+#ifdef STRFORMAT_SSE2
+		__m128i m = _mm_set1_epi8(15);
+		for (; i + 16 <= n; i += 16) {
+			__m128i b = _mm_loadu_si128((__m128i const *)(src + i));
+			__m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), m);
+			__m128i lo = _mm_and_si128(b, m);
+			_mm_storeu_si128((__m128i *)dst, hex_ascii(_mm_unpacklo_epi8(hi, lo), upper));
+			_mm_storeu_si128((__m128i *)(dst + 16), hex_ascii(_mm_unpackhi_epi8(hi, lo), upper));
+			dst += 32;
+		}
+#endif
+		for (; i < n; i++) {
+			*dst++ = digits[src[i] >> 4];
+			*dst++ = digits[src[i] & 15];
+		}
+		return dst;
+	}
+	/**
+	 * @brief Buffer size write_hexdump() needs for `n` bytes.
+	 */
+	static size_t hexdump_bound(size_t n)
+	{
+		return (n + 15) / 16 * 88 + 17;
+	}
+	/**
+	 * @brief Write `n` bytes in the layout of "hexdump -C -v".
+	 *
+	 * Each line holds an 8-digit offset, 16 bytes in hex split into two
+	 * halves, and the printable ASCII characters between '|'.  A last line
+	 * holds the total size.  Nothing is written for an empty buffer.
+	 *
+	 * @param dst Must hold hexdump_bound(n) bytes.
+	 */
+	static char *write_hexdump(char *dst, void const *data, size_t n, bool upper)
+	{
+		uint8_t const *src = (uint8_t const *)data;
+		auto Offset = [&](uint64_t off){
+			if (off >> 32) {
+				uint64_t be = bswap64(off);
+				dst = write_hex_bytes(dst, &be, 8, upper);
+			} else {
+				uint64_t be = bswap64(off << 32);
+				dst = write_hex_bytes(dst, &be, 4, upper);
+			}
+		};
+		for (size_t off = 0; off < n; off += 16) {
+			size_t len = std::min(n - off, (size_t)16);
+			uint8_t const *line = src + off;
+			char hex[32];
+			write_hex_bytes(hex, line, len, upper);
+			Offset(off);
+			*dst++ = ' ';
+			for (size_t i = 0; i < 16; i++) {
+				if (i == 0 || i == 8) {
+					*dst++ = ' ';
+				}
+				if (i < len) {
+					dst[0] = hex[2 * i];
+					dst[1] = hex[2 * i + 1];
+				} else {
+					dst[0] = dst[1] = ' ';
+				}
+				dst[2] = ' ';
+				dst += 3;
+			}
+			*dst++ = ' ';
+			*dst++ = '|';
+			size_t i = 0;
+#ifdef STRFORMAT_SSE2
+			if (len == 16) {
+				__m128i b = _mm_loadu_si128((__m128i const *)line);
+				__m128i printable = _mm_and_si128(_mm_cmpgt_epi8(b, _mm_set1_epi8(0x1f)), _mm_cmplt_epi8(b, _mm_set1_epi8(0x7f)));
+				__m128i c = _mm_or_si128(_mm_and_si128(printable, b), _mm_andnot_si128(printable, _mm_set1_epi8('.')));
+				_mm_storeu_si128((__m128i *)dst, c);
+				i = 16;
+			}
+#endif
+			for (; i < len; i++) {
+				uint8_t c = line[i];
+				dst[i] = c >= 0x20 && c < 0x7f ? char(c) : '.';
+			}
+			dst += len;
+			*dst++ = '|';
+			*dst++ = '\n';
+		}
+		if (n > 0) {
+			Offset(n);
+			*dst++ = '\n';
+		}
+		return dst;
+	}
+	/**
+	 * @brief Year, month and day of the `days`-th day after 1970-01-01.
+	 *
+	 * H. Hinnant's civil_from_days(), valid for any day count.
+	 */
+	static void civil_from_days(int64_t days, int64_t *year, unsigned *month, unsigned *day)
+	{
+		days += 719468;
+		int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+		unsigned doe = unsigned(days - era * 146097);
+		unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+		unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+		unsigned mp = (5 * doy + 2) / 153;
+		*day = doy - (153 * mp + 2) / 5 + 1;
+		*month = mp < 10 ? mp + 3 : mp - 9;
+		*year = int64_t(yoe) + era * 400 + (*month <= 2);
+	}
+	/**
+	 * @brief Buffer size write_timestamp() needs.
+	 */
+	static constexpr size_t timestamp_bound()
+	{
+		return 40;
+	}
+	/**
+	 * @brief Write `ns` nanoseconds after the Unix epoch as ISO 8601,
+	 *        "YYYY-MM-DDTHH:MM:SS[.fff][Z|+hh:mm]".
+	 *
+	 * The date and time are shifted by `offset_minutes`.  The text up to the
+	 * seconds is cached per thread, so calls within the same second only
+	 * write the fraction and the zone.
+	 *
+	 * @param precision Fraction digits, 0 to 9.
+	 * @param zone      Append "Z" for a zero offset, "+hh:mm" otherwise.
+	 * @param dst       Must hold timestamp_bound() bytes.
+	 */
+	static char *write_timestamp(char *dst, int64_t ns, int offset_minutes, int precision, bool zone)
+	{
+		int64_t sec = ns / 1000000000;
+		int64_t frac = ns % 1000000000;
+		if (frac < 0) {
+			frac += 1000000000;
+			sec--;
+		}
+		sec += int64_t(offset_minutes) * 60;
+		struct Cache {
+			int64_t sec = INT64_MIN;
+			char text[20];
+		};
+		thread_local Cache cache;
+		char const *pairs = digit_pairs();
+		if (cache.sec != sec) {
+			int64_t days = (sec >= 0 ? sec : sec - 86399) / 86400;
+			unsigned t = unsigned(sec - days * 86400);
+			int64_t year;
+			unsigned month, day;
+			civil_from_days(days, &year, &month, &day);
+			unsigned y = unsigned(year < 0 ? 0 : year > 9999 ? 9999 : year);
+			char *p = cache.text;
+			memcpy(p + 0, pairs + y / 100 * 2, 2);
+			memcpy(p + 2, pairs + y % 100 * 2, 2);
+			p[4] = '-';
+			memcpy(p + 5, pairs + month * 2, 2);
+			p[7] = '-';
+			memcpy(p + 8, pairs + day * 2, 2);
+			p[10] = 'T';
+			memcpy(p + 11, pairs + t / 3600 * 2, 2);
+			p[13] = ':';
+			memcpy(p + 14, pairs + t / 60 % 60 * 2, 2);
+			p[16] = ':';
+			memcpy(p + 17, pairs + t % 60 * 2, 2);
+			cache.sec = sec;
+		}
+		memcpy(dst, cache.text, 19);
+		dst += 19;
+		if (precision > 0) {
+			char digits[10];
+			uint32_t f = uint32_t(frac);
+			digits[0] = char('0' + f / 100000000);
+			f %= 100000000;
+			memcpy(digits + 1, pairs + f / 1000000 * 2, 2);
+			memcpy(digits + 3, pairs + f / 10000 % 100 * 2, 2);
+			memcpy(digits + 5, pairs + f / 100 % 100 * 2, 2);
+			memcpy(digits + 7, pairs + f % 100 * 2, 2);
+			*dst++ = '.';
+			memcpy(dst, digits, precision);
+			dst += precision;
+		}
+		if (zone) {
+			if (offset_minutes == 0) {
+				*dst++ = 'Z';
+			} else {
+				unsigned m = unsigned(offset_minutes < 0 ? -offset_minutes : offset_minutes);
+				*dst++ = offset_minutes < 0 ? '-' : '+';
+				memcpy(dst, pairs + m / 60 % 100 * 2, 2);
+				dst[2] = ':';
+				memcpy(dst + 3, pairs + m % 60 * 2, 2);
+				dst += 5;
+			}
+		}
+		return dst;
+	}
+	/**
+	 * @brief Buffer size write_decimal() needs.
+	 */
+	static constexpr size_t decimal_bound(int precision)
+	{
+		return 24 + precision;
+	}
+	/**
+	 * @brief Write `value` / 10^`scale` exactly with `precision` fraction
+	 *        digits, rounding half to even as "%.Nf" does for exact ties.
+	 *
+	 * Only integer arithmetic is used.
+	 *
+	 * @param scale Implied decimals of `value`, 0 to 18.
+	 * @param dst   Must hold decimal_bound(precision) bytes.
+	 */
+	static char *write_decimal(char *dst, int64_t value, int scale, int precision, bool plus)
+	{
+		static const uint64_t pow10[] = {
+			1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+			10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+			100000000000ull, 1000000000000ull, 10000000000000ull,
+			100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+			100000000000000000ull, 1000000000000000000ull,
+		};
+		scale = std::clamp(scale, 0, 18);
+		precision = std::max(precision, 0);
+		uint64_t mag = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+		int digits = std::min(precision, scale); // fraction digits taken from the value
+		if (digits < scale) {
+			uint64_t div = pow10[scale - digits];
+			uint64_t half = div / 2;
+			uint64_t r = mag % div;
+			mag /= div;
+			if (r > half || (r == half && (mag & 1))) {
+				mag++;
+			}
+		}
+		if (value < 0) {
+			*dst++ = '-';
+		} else if (plus) {
+			*dst++ = '+';
+		}
+		uint64_t frac = mag % pow10[digits];
+		dst = write_uint64(dst, mag / pow10[digits]);
+		if (precision > 0) {
+			*dst++ = '.';
+			for (int i = digits; i > 0; i--) {
+				dst[i - 1] = char('0' + frac % 10);
+				frac /= 10;
+			}
+			memset(dst + digits, '0', precision - digits);
+			dst += precision;
+		}
+		return dst;
+	}
+	/**
+	 * @brief Buffer size write_array() needs for `count` elements.
+	 */
+	static size_t array_bound(size_t count, size_t delimiter)
+	{
+		return count * (21 + delimiter);
+	}
+	/**
+	 * @brief Write `count` integers separated by `delimiter`.
+	 *
+	 * Decimal output matches "%d"/"%ld"/"%u"/"%lu", with '+' before positive
+	 * signed values when `plus` is set.  Hex output matches "%x": negative
+	 * values print as their two's complement of the element width.
+	 *
+	 * @param dst Must hold array_bound(count, delimiter.size()) bytes.
+	 * @return Pointer past the last character written.
+	 */
+	template <typename T> static char *write_array(char *dst, T const *values, size_t count, std::string_view delimiter, bool hex = false, bool upper = false, bool plus = false)
+	{
+		static_assert(std::is_integral<T>::value && sizeof(T) >= 4, "32 or 64-bit integers only");
+		using U = typename std::make_unsigned<T>::type;
+		auto Join = [&](auto const &emit){
+			if (count == 0) return;
+			dst = emit(dst, values[0]);
+			if (delimiter.size() == 1) {
+				char c = delimiter[0];
+				for (size_t i = 1; i < count; i++) {
+					*dst++ = c;
+					dst = emit(dst, values[i]);
+				}
+			} else {
+				for (size_t i = 1; i < count; i++) {
+					memcpy(dst, delimiter.data(), delimiter.size());
+					dst = emit(dst + delimiter.size(), values[i]);
+				}
+			}
+		};
+		if (hex) {
+			Join([upper](char *d, T v){
+				return write_hex64(d, (U)v, upper);
+			});
+		} else if (std::is_signed<T>::value) {
+			Join([plus](char *d, T v){
+				U u = (U)v;
+				if (v < 0) {
+					*d++ = '-';
+					u = U(0) - u;
+				} else if (plus && v != 0) {
+					*d++ = '+';
+				}
+				return write_uint64(d, u);
+			});
+		} else {
+			Join([](char *d, T v){
+				return write_uint64(d, (U)v);
+			});
+		}
+		return dst;
+	}
+#ifndef STRFORMAT_NO_FP
+	/**
+	 * @brief Buffer size write_fixed() needs for `val`.
+	 */
+	static size_t fixed_bound(double val, int precision)
+	{
+		return (std::fabs(val) < 1e17 ? 21 : 400) + precision;
+	}
+	/**
+	 * @brief "%.Nf" of one value, as format_double() prints it.
+	 *
+	 * NaN and infinity print as "#NAN" and "#INF".
+	 */
+	static char *write_fixed(char *dst, char *end, double val, int precision, bool plus)
+	{
+		if (std::isnan(val)) return (char *)memcpy(dst, "#NAN", 4) + 4;
+		if (std::isinf(val)) return (char *)memcpy(dst, "#INF", 4) + 4;
+		if (std::signbit(val)) {
+			*dst++ = '-';
+			val = -val;
+		} else if (plus) {
+			*dst++ = '+';
+		}
+		char *e = format_fixed_small(dst, val, precision);
+		if (!e) {
+			e = std::to_chars(dst, end, val, std::chars_format::fixed, precision).ptr;
+		}
+		return e;
+	}
+	/**
+	 * @brief Buffer size write_hexfloat() needs.
+	 */
+	static constexpr size_t hexfloat_bound(int precision)
+	{
+		return 32 + (precision < 0 ? 0 : precision);
+	}
+	/**
+	 * @brief Write `val` as a hexadecimal float like "%a": "0x1.8p+1".
+	 *
+	 * The digits come straight from the bits of the double, so the output
+	 * is exact.  Without a precision trailing zeros are dropped; otherwise
+	 * the mantissa is rounded half to even.  Subnormals print as
+	 * "0x0.xxxp-1022", NaN and infinity as "#NAN" and "#INF".
+	 *
+	 * @param alt Keep the '.' when no digits follow it.
+	 * @param dst Must hold hexfloat_bound(precision) bytes.
+	 */
+	static char *write_hexfloat(char *dst, double val, int precision, bool upper, bool plus, bool alt = false)
+	{
+		uint64_t bits;
+		memcpy(&bits, &val, 8);
+		bool negative = bits >> 63;
+		int exp = int(bits >> 52) & 0x7ff;
+		uint64_t mant = bits & 0xfffffffffffffull;
+		if (exp == 0x7ff) {
+			if (mant != 0) return (char *)memcpy(dst, "#NAN", 4) + 4;
+			if (negative) *dst++ = '-';
+			return (char *)memcpy(dst, "#INF", 4) + 4;
+		}
+		if (negative) {
+			*dst++ = '-';
+		} else if (plus) {
+			*dst++ = '+';
+		}
+		int e = exp == 0 ? (mant == 0 ? 0 : -1022) : exp - 1023;
+		uint64_t lead = exp == 0 ? 0 : 1;
+		int digits = 13;
+		if (precision >= 0 && precision < 13) {
+			int shift = 4 * (13 - precision);
+			uint64_t full = lead << 52 | mant;
+			uint64_t rem = full & ((uint64_t(1) << shift) - 1);
+			uint64_t half = uint64_t(1) << (shift - 1);
+			full >>= shift;
+			if (rem > half || (rem == half && (full & 1))) {
+				full++;
+			}
+			digits = precision;
+			lead = full >> (4 * digits); // may become 2, as in printf
+			mant = full << (52 - 4 * digits);
+		} else if (precision < 0) {
+			while (digits > 0 && (mant & 15) == 0) {
+				mant >>= 4;
+				digits--;
+			}
+			mant <<= 4 * (13 - digits);
+		}
+		char const *hex = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+		*dst++ = '0';
+		*dst++ = upper ? 'X' : 'x';
+		*dst++ = hex[lead];
+		if (digits > 0 || precision > 0 || alt) {
+			*dst++ = '.';
+		}
+		for (int i = 0; i < digits; i++) {
+			*dst++ = hex[(mant >> (48 - 4 * i)) & 15];
+		}
+		if (precision > 13) {
+			memset(dst, '0', precision - 13);
+			dst += precision - 13;
+		}
+		*dst++ = upper ? 'P' : 'p';
+		*dst++ = e < 0 ? '-' : '+';
+		return write_uint64(dst, uint64_t(e < 0 ? -e : e));
+	}
+	/**
+	 * @brief Buffer size write_fixed_array() needs.
+	 *
+	 * Only values of 10^17 and above can exceed the short bound; they are
+	 * counted two at a time with SSE2.
+	 */
+	static size_t fixed_array_bound(double const *values, size_t count, int precision, size_t delimiter)
+	{
+		size_t large = 0;
+		size_t i = 0;
+#ifdef STRFORMAT_SSE2
+		__m128d limit = _mm_set1_pd(1e17);
+		__m128d abs = _mm_castsi128_pd(_mm_set1_epi64x(0x7fffffffffffffff));
+		for (; i + 2 <= count; i += 2) {
+			__m128d a = _mm_and_pd(_mm_loadu_pd(values + i), abs);
+			int m = _mm_movemask_pd(_mm_cmpnlt_pd(a, limit));
+			large += (m & 1) + (m >> 1);
+		}
+#endif
+		for (; i < count; i++) {
+			large += !(std::fabs(values[i]) < 1e17);
+		}
+		return count * (21 + precision + delimiter) + large * (400 - 21) + 16;
+	}
+#ifdef STRFORMAT_SSE2
+	/**
+	 * @brief round(|v| * p) for two values, half-even on the exact product.
+	 *
+	 * Same arithmetic as format_fixed_small(): TwoProduct, then a floor
+	 * through the 2^52 bias and an exact comparison with one half.
+	 *
+	 * @return Mask of lanes that must take the general path: NaN,
+	 *         infinity, -0.0, or a scaled value of 2^52 and above.
+	 */
+	static int scale_round2(double const *v, double p, uint64_t r[2])
+	{
+		__m128d two52 = _mm_set1_pd(4503599627370496.0);
+		__m128d one = _mm_set1_pd(1.0);
+		__m128d zero = _mm_setzero_pd();
+		__m128d x = _mm_loadu_pd(v);
+		__m128d a = _mm_andnot_pd(_mm_set1_pd(-0.0), x);
+		__m128d pp = _mm_set1_pd(p);
+		__m128d hi = _mm_mul_pd(a, pp);
+		int bad = _mm_movemask_pd(_mm_cmpnlt_pd(hi, two52)) | _mm_movemask_pd(_mm_and_pd(_mm_cmpeq_pd(x, zero), x));
+		__m128d split = _mm_set1_pd(134217729.0);
+		__m128d c = _mm_mul_pd(split, a);
+		__m128d ah = _mm_sub_pd(c, _mm_sub_pd(c, a));
+		__m128d al = _mm_sub_pd(a, ah);
+		double c2 = 134217729.0 * p;
+		double ph_ = c2 - (c2 - p);
+		__m128d ph = _mm_set1_pd(ph_);
+		__m128d pl = _mm_set1_pd(p - ph_);
+		__m128d lo = _mm_sub_pd(_mm_mul_pd(ah, ph), hi);
+		lo = _mm_add_pd(lo, _mm_mul_pd(ah, pl));
+		lo = _mm_add_pd(lo, _mm_mul_pd(al, ph));
+		lo = _mm_add_pd(lo, _mm_mul_pd(al, pl));
+		__m128d f = _mm_sub_pd(_mm_add_pd(hi, two52), two52); // nearest
+		f = _mm_sub_pd(f, _mm_and_pd(_mm_cmpgt_pd(f, hi), one)); // floor
+		__m128d t = _mm_add_pd(_mm_sub_pd(_mm_sub_pd(hi, f), _mm_set1_pd(0.5)), lo);
+		__m128i fi = _mm_and_si128(_mm_castpd_si128(_mm_add_pd(f, two52)), _mm_set1_epi64x(0xfffffffffffff));
+		__m128i up = _mm_castpd_si128(_mm_cmpgt_pd(t, zero));
+		__m128i tie = _mm_and_si128(_mm_castpd_si128(_mm_cmpeq_pd(t, zero)), fi);
+		__m128i inc = _mm_and_si128(_mm_or_si128(up, tie), _mm_set1_epi64x(1));
+		_mm_storeu_si128((__m128i *)r, _mm_add_epi64(fi, inc));
+		return bad;
+	}
+#endif
+	/**
+	 * @brief Write exactly N digits of `v` (< 10^N), with leading zeros.
+	 */
+	template <int N> static char *write_fraction(char *dst, uint64_t v)
+	{
+#ifdef STRFORMAT_SSE2
+		__m128i d = N <= 8 ? _mm_packus_epi16(_mm_setzero_si128(), digits8(uint32_t(v))) : digits16(v);
+		return store_tail(dst, _mm_add_epi8(d, _mm_set1_epi8('0')), 16 - N);
+#else
+		char const *pairs = digit_pairs();
+		char *p = dst + N;
+		int n = N;
+		while (n >= 2) {
+			p -= 2;
+			memcpy(p, pairs + (v % 100) * 2, 2);
+			v /= 100;
+			n -= 2;
+		}
+		if (n == 1) {
+			*--p = char('0' + v);
+		}
+		return dst + N;
+#endif
+	}
+	template <int N> static char *write_fixed_array_n(char *dst, char *end, double const *values, size_t count, std::string_view delimiter, bool plus)
+	{
+		auto Delimit = [&](size_t i){
+			if (i > 0) {
+				memcpy(dst, delimiter.data(), delimiter.size());
+				dst += delimiter.size();
+			}
+		};
+		size_t i = 0;
+#ifdef STRFORMAT_SSE2
+		constexpr uint64_t scale = [](){
+			uint64_t s = 1;
+			for (int i = 0; i < N; i++) s *= 10;
+			return s;
+		}();
+		auto Emit = [&](double v, uint64_t r){
+			if (std::signbit(v)) {
+				*dst++ = '-';
+			} else if (plus) {
+				*dst++ = '+';
+			}
+			dst = write_uint64(dst, r / scale);
+			if (N > 0) {
+				*dst++ = '.';
+				dst = write_fraction<N>(dst, r % scale);
+			}
+		};
+		for (; i + 2 <= count; i += 2) {
+			uint64_t r[2];
+			int bad = scale_round2(values + i, double(scale), r);
+			for (int k = 0; k < 2; k++) {
+				Delimit(i + k);
+				if (bad & (1 << k)) {
+					dst = write_fixed(dst, end, values[i + k], N, plus);
+				} else {
+					Emit(values[i + k], r[k]);
+				}
+			}
+		}
+#endif
+		for (; i < count; i++) {
+			Delimit(i);
+			dst = write_fixed(dst, end, values[i], N, plus);
+		}
+		return dst;
+	}
+	/**
+	 * @brief Write `count` doubles as "%.Nf" separated by `delimiter`.
+	 *
+	 * Output matches format_double() element by element.  Precisions up to
+	 * 15 take the batched path; NaN, infinity and out-of-range values (and
+	 * every value at higher precisions) go through write_fixed().
+	 *
+	 * @param dst Must hold fixed_array_bound() bytes.
+	 */
+	static char *write_fixed_array(char *dst, double const *values, size_t count, int precision, std::string_view delimiter, bool plus = false)
+	{
+		char *end = dst + fixed_array_bound(values, count, precision, delimiter.size());
+		switch (precision) {
+		case 0:  return write_fixed_array_n<0>(dst, end, values, count, delimiter, plus);
+		case 1:  return write_fixed_array_n<1>(dst, end, values, count, delimiter, plus);
+		case 2:  return write_fixed_array_n<2>(dst, end, values, count, delimiter, plus);
+		case 3:  return write_fixed_array_n<3>(dst, end, values, count, delimiter, plus);
+		case 4:  return write_fixed_array_n<4>(dst, end, values, count, delimiter, plus);
+		case 5:  return write_fixed_array_n<5>(dst, end, values, count, delimiter, plus);
+		case 6:  return write_fixed_array_n<6>(dst, end, values, count, delimiter, plus);
+		case 7:  return write_fixed_array_n<7>(dst, end, values, count, delimiter, plus);
+		case 8:  return write_fixed_array_n<8>(dst, end, values, count, delimiter, plus);
+		case 9:  return write_fixed_array_n<9>(dst, end, values, count, delimiter, plus);
+		case 10: return write_fixed_array_n<10>(dst, end, values, count, delimiter, plus);
+		case 11: return write_fixed_array_n<11>(dst, end, values, count, delimiter, plus);
+		case 12: return write_fixed_array_n<12>(dst, end, values, count, delimiter, plus);
+		case 13: return write_fixed_array_n<13>(dst, end, values, count, delimiter, plus);
+		case 14: return write_fixed_array_n<14>(dst, end, values, count, delimiter, plus);
+		case 15: return write_fixed_array_n<15>(dst, end, values, count, delimiter, plus);
+		}
+		for (size_t i = 0; i < count; i++) {
+			if (i > 0) {
+				memcpy(dst, delimiter.data(), delimiter.size());
+				dst += delimiter.size();
+			}
+			dst = write_fixed(dst, end, values[i], precision, plus);
+		}
+		return dst;
+	}
+#endif
+private:
+	/**
+	 * @brief Return 10 raised to an integer power.
+	 *
+	 * A small lookup table is used for the most common range to avoid
+	 * calling the comparatively expensive `pow()` routine.  Values outside
+	 * the table range fall back to `pow(10.0, exp)`.
+	 *
+	 * @param exp Decimal exponent (positive or negative).
+	 * @return The value 10^exp as a double.
+	 */
+	static double pow10_int(int exp)
+	{
+		// Pre‑computed powers for |exp| ≤ 16
+		static const double tbl[] = {
+			1e+00, 1e+01, 1e+02, 1e+03, 1e+04, 1e+05, 1e+06,
+			1e+07, 1e+08, 1e+09, 1e+10, 1e+11, 1e+12, 1e+13,
+			1e+14, 1e+15, 1e+16
+		};
+		if (exp >= 0 && exp < static_cast<int>(sizeof tbl / sizeof *tbl))
+			return tbl[exp];
+		if (exp <= 0 && exp > -static_cast<int>(sizeof tbl / sizeof *tbl))
+			return 1.0 / tbl[-exp];
+		// Rare case: delegate to libm
+		return std::pow(10.0, exp);
+	}
+public:
+	/**
+	 * @brief Parse the digits of a hexadecimal float, after any sign and the
+	 *        "0x" prefix: "1.8p+1".
+	 *
+	 * The result is rounded to nearest even from all digits, subnormals
+	 * included.
+	 *
+	 * @param endptr If non-null, receives the end of the parsed text, or `p`
+	 *               if there are no hex digits.
+	 */
+	static double parse_hexfloat(char const *p, char const **endptr)
+	{
+		static const struct Table {
+			int8_t v[256];
+			constexpr Table()
+				: v()
+			{
+				for (int i = 0; i < 256; i++) {
+					v[i] = i >= '0' && i <= '9' ? i - '0' : i >= 'a' && i <= 'f' ? i - 'a' + 10 : i >= 'A' && i <= 'F' ? i - 'A' + 10 : -1;
+				}
+			}
+		} table;
+		auto Digit = [](char c){
+			return table.v[(unsigned char)c];
+		};
+		char const *s = p;
+		uint64_t mant = 0;
+		int bin_exp = 0;
+		bool sticky = false;
+		bool fraction = false;
+		bool any = false;
+		while (1) {
+			int d = Digit(*s);
+			if (d < 0) {
+				if (*s == '.' && !fraction) {
+					fraction = true;
+					s++;
+					continue;
+				}
+				break;
+			}
+			any = true;
+			if (mant >> 60 == 0) {
+				mant = mant << 4 | unsigned(d);
+				if (fraction) bin_exp -= 4;
+			} else {
+				sticky |= d != 0;
+				if (!fraction) bin_exp += 4;
+			}
+			s++;
+		}
+		if (!any) {
+			if (endptr) *endptr = p;
+			return 0;
+		}
+		if (*s == 'p' || *s == 'P') {
+			char const *t = s + 1;
+			bool neg = *t == '-';
+			if (*t == '+' || *t == '-') t++;
+			if (isdigit((unsigned char)*t)) {
+				int e = 0;
+				while (isdigit((unsigned char)*t)) {
+					if (e < 100000) e = e * 10 + (*t - '0');
+					t++;
+				}
+				bin_exp += neg ? -e : e;
+				s = t;
+			}
+		}
+		if (endptr) *endptr = s;
+		if (mant == 0) return 0;
+		if (sticky) mant |= 1; // far below the rounding position: mant has 61+ bits
+		int top = 63 - clz64(mant);
+		int e = top + bin_exp; // value is in [2^e, 2^(e+1))
+		int keep = e >= -1022 ? 53 : 53 - (-1022 - e);
+		if (keep < 0) return 0;
+		int shift = top + 1 - keep;
+		if (shift > 0) {
+			uint64_t rem = shift == 64 ? mant : mant & ((uint64_t(1) << shift) - 1);
+			uint64_t half = uint64_t(1) << (shift - 1);
+			mant = shift == 64 ? 0 : mant >> shift;
+			if (rem > half || (rem == half && (mant & 1))) {
+				mant++;
+			}
+			bin_exp += shift;
+		}
+		return std::ldexp(double(mant), bin_exp);
+	}
+	/**
+	 * @brief Locale‑independent `strtod` clone.
+	 *
+	 * Parses a floating‑point literal from a C‑string.  Leading white‑space,
+	 * an optional sign, fractional part (with a mandatory '.' as the decimal
+	 * separator), and an optional exponent (`e`/`E`) are recognised.
+	 *
+	 * The implementation **ignores the current locale**; the decimal point
+	 * must be `'.'` and no thousands separators are accepted.
+	 *
+	 * @param nptr   Pointer to NUL‑terminated text to parse.
+	 * @param endptr If non‑NULL, receives a pointer to the first character
+	 *               following the parsed number (or `nptr` on failure).
+	 * @return The parsed value.
+	 */
+	static double my_strtod(const char *nptr, char **endptr)
+	{
+		const char *s = nptr;
+		bool sign = false;
+		bool saw_digit = false;
+		int frac_digits = 0;
+		long exp_val = 0;
+		bool exp_sign = false;
+		double value = 0.0;
+
+		// Skip leading white‑space
+		while (std::isspace((unsigned char)*s)) ++s;
+
+		// Parse optional sign
+		if (*s == '+' || *s == '-') {
+			if (*s == '-') sign = true;
+			s++;
+		}
+
+		// Hexadecimal float, and the tokens written for NaN and infinity
+		if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+			char const *end;
+			double v = parse_hexfloat(s + 2, &end);
+			if (end != s + 2) {
+				if (endptr) *endptr = const_cast<char *>(end);
+				return sign ? -v : v;
+			}
+		} else if (strncmp(s, "#INF", 4) == 0 || strncmp(s, "#NAN", 4) == 0) {
+			if (endptr) *endptr = const_cast<char *>(s + 4);
+			double v = s[1] == 'I' ? HUGE_VAL : NAN;
+			return sign ? -v : v;
+		}
+
+		// Integer part
+		while (std::isdigit((unsigned char)*s)) {
+			saw_digit = true;
+			value = value * 10.0 + (*s - '0');
+			s++;
+		}
+
+		// Fractional part
+		if (*s == '.') {
+			s++;
+			while (std::isdigit((unsigned char)*s)) {
+				saw_digit = true;
+				value = value * 10.0 + (*s - '0');
+				s++;
+				frac_digits++;
+			}
+		}
+
+		// No digits at all -> conversion failure
+		if (!saw_digit) {
+			if (endptr) *endptr = const_cast<char *>(nptr);
+			return 0.0;
+		}
+
+		// Exponent part
+		if (*s == 'e' || *s == 'E') {
+			s++;
+			const char *exp_start = s;
+			if (*s == '+' || *s == '-') {
+				if (*s == '-') exp_sign = true;
+				s++;
+			}
+			if (std::isdigit((unsigned char)*s)) {
+				while (std::isdigit((unsigned char)*s)) {
+					exp_val = exp_val * 10 + (*s - '0');
+					s++;
+				}
+				if (exp_sign) {
+					exp_val = -exp_val;
+				}
+			} else {
+				// Roll back if 'e' is not followed by a valid exponent
+				s = exp_start - 1;
+			}
+		}
+
+		// Scale by 10^(exponent − #fractional‑digits)
+		int total_exp = exp_val - frac_digits;
+		if (total_exp != 0) {
+			value *= pow10_int(total_exp);
+		}
+
+		// Apply sign
+		if (sign) {
+			value = -value;
+		}
+
+		// Set errno on overflow/underflow
 		if (!std::isfinite(value)) {
 			// errno = ERANGE;
 			value = sign ? -HUGE_VAL : HUGE_VAL;
@@ -257,143 +1545,1358 @@ public:
 			// errno = ERANGE;  // underflow
 		}
 
-		// Report where parsing stopped
-		if (endptr) *endptr = const_cast<char *>(s);
-		return value;
+		// Report where parsing stopped
+		if (endptr) *endptr = const_cast<char *>(s);
+		return value;
+	}
+};
+
+/**
+ * @brief UTF-8 measurement helpers used by the `Utf8` formatter mode.
+ */
+class utf8 {
+public:
+	constexpr static uint32_t replacement_character = 0xfffd;
+
+	/**
+	 * @brief Length of the leading run of ASCII bytes.
+	 *
+	 * Checks 16 bytes at a time with SSE2 where available.
+	 */
+	static size_t ascii_prefix(char const *ptr, size_t len)
+	{
+		size_t i = 0;
+#ifdef STRFORMAT_SSE2
+		for (; i + 16 <= len; i += 16) {
+			int m = _mm_movemask_epi8(_mm_loadu_si128((__m128i const *)(ptr + i)));
+			if (m) return i + misc::ctz32(m);
+		}
+#endif
+		while (i < len && !(ptr[i] & 0x80)) {
+			i++;
+		}
+		return i;
+	}
+
+	/**
+	 * @brief Decode one code point.
+	 *
+	 * @return Number of bytes consumed.  For an ill-formed sequence the
+	 *         negated length of its maximal subpart is returned (always at
+	 *         least one byte) and `*cp` is left untouched.
+	 */
+	static int decode(char const *ptr, char const *end, uint32_t *cp)
+	{
+		unsigned char const *p = (unsigned char const *)ptr;
+		uint32_t c = p[0];
+		if (c < 0x80) {
+			*cp = c;
+			return 1;
+		}
+		int n;
+		uint32_t lo = 0x80;
+		uint32_t hi = 0xbf;
+		if (c >= 0xc2 && c <= 0xdf) {
+			n = 1;
+			c &= 0x1f;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			n = 2;
+			if (c == 0xe0) lo = 0xa0;
+			if (c == 0xed) hi = 0x9f; // surrogates
+			c &= 0x0f;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			n = 3;
+			if (c == 0xf0) lo = 0x90;
+			if (c == 0xf4) hi = 0x8f; // > U+10FFFF
+			c &= 0x07;
+		} else {
+			return -1;
+		}
+		for (int i = 1; i <= n; i++) {
+			if ((char const *)p + i >= end || p[i] < lo || p[i] > hi) {
+				return -i;
+			}
+			c = (c << 6) | (p[i] & 0x3f);
+			lo = 0x80;
+			hi = 0xbf;
+		}
+		*cp = c;
+		return n + 1;
+	}
+
+	/**
+	 * @brief Display width of a code point.
+	 *
+	 * Without `east_asian` every code point is one column.  Otherwise a
+	 * compact approximation of UAX #11 is used: wide and fullwidth
+	 * characters take two columns, combining marks and zero-width
+	 * characters take none.
+	 */
+	static int width(uint32_t cp, bool east_asian)
+	{
+		if (!east_asian || cp < 0x300) return 1;
+		struct Range {
+			uint32_t lo;
+			uint32_t hi;
+		};
+		static const Range zero[] = {
+			{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x1ab0, 0x1aff },
+			{ 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x2028, 0x202e }, { 0x2060, 0x2064 },
+			{ 0x20d0, 0x20ff }, { 0x3099, 0x309a }, { 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f },
+			{ 0xfeff, 0xfeff }, { 0xe0100, 0xe01ef },
+		};
+		static const Range wide[] = {
+			{ 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a }, { 0x23e9, 0x23ec },
+			{ 0x25fd, 0x25fe }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 }, { 0x26aa, 0x26ab },
+			{ 0x26bd, 0x26be }, { 0x26c4, 0x26c5 }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+			{ 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x2753, 0x2755 }, { 0x2795, 0x2797 },
+			{ 0x2b1b, 0x2b1c }, { 0x2b50, 0x2b50 }, { 0x2e80, 0x303e }, { 0x3041, 0x33ff },
+			{ 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf }, { 0xa960, 0xa97f },
+			{ 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 }, { 0xfe30, 0xfe6f },
+			{ 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x16fe0, 0x18aff }, { 0x1b000, 0x1b2ff },
+			{ 0x1f300, 0x1f64f }, { 0x1f680, 0x1f6ff }, { 0x1f900, 0x1f9ff }, { 0x1fa70, 0x1faff },
+			{ 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+		};
+		auto Find = [cp](Range const *begin, Range const *end){
+			Range const *r = std::lower_bound(begin, end, cp, [](Range const &r, uint32_t v){ return r.hi < v; });
+			return r != end && r->lo <= cp;
+		};
+		if (Find(std::begin(zero), std::end(zero))) return 0;
+		if (Find(std::begin(wide), std::end(wide))) return 2;
+		return 1;
+	}
+
+	/**
+	 * @brief Measure a string, optionally stopping at a column limit.
+	 */
+	struct Measure {
+		size_t bytes = 0;	// length of the prefix that fits in the limit
+		int columns = 0;	// display width of that prefix
+		int invalid = 0;	// number of ill-formed sequences in that prefix
+	};
+	static Measure measure(char const *ptr, size_t len, int limit, bool east_asian)
+	{
+		Measure m;
+		if (limit < 0) limit = INT32_MAX;
+		char const *end = ptr + len;
+		char const *p = ptr;
+		while (p < end) {
+			size_t n = ascii_prefix(p, end - p);
+			if (n > 0) {
+				if (n > size_t(limit - m.columns)) {
+					n = limit - m.columns;
+				}
+				p += n;
+				m.columns += (int)n;
+				if (m.columns >= limit || p == end) break;
+			}
+			uint32_t cp = replacement_character;
+			int k = decode(p, end, &cp);
+			int w = width(cp, east_asian);
+			if (m.columns + w > limit) break;
+			m.columns += w;
+			if (k < 0) {
+				m.invalid++;
+				k = -k;
+			}
+			p += k;
+		}
+		m.bytes = p - ptr;
+		return m;
+	}
+
+	/**
+	 * @brief Copy a string replacing each ill-formed sequence with U+FFFD.
+	 *
+	 * @return Pointer past the last byte written.
+	 */
+	static char *copy_replacing_invalid(char *dst, char const *ptr, size_t len)
+	{
+		char const *end = ptr + len;
+		while (ptr < end) {
+			size_t n = ascii_prefix(ptr, end - ptr);
+			memcpy(dst, ptr, n);
+			dst += n;
+			ptr += n;
+			if (ptr == end) break;
+			uint32_t cp;
+			int k = decode(ptr, end, &cp);
+			if (k < 0) {
+				*dst++ = (char)0xef;
+				*dst++ = (char)0xbf;
+				*dst++ = (char)0xbd;
+				k = -k;
+			} else {
+				memcpy(dst, ptr, k);
+				dst += k;
+			}
+			ptr += k;
+		}
+		return dst;
+	}
+};
+
+/**
+ * @brief Escaping for "%j" (JSON string contents) and "%m" (XML/HTML text).
+ *
+ * JSON escapes '"', '\' and control characters; markup escapes & < > " '.
+ * Other bytes, including UTF-8 sequences, are copied as they are.
+ */
+class escape {
+public:
+	enum Mode {
+		Json,
+		Markup,
+	};
+
+	/**
+	 * @brief Next byte in [p, end) that needs escaping, or end.
+	 *
+	 * Clean 16-byte blocks are skipped with SSE2 where available.
+	 */
+	static char const *find(char const *p, char const *end, Mode mode)
+	{
+#ifdef STRFORMAT_SSE2
+		while (end - p >= 16) {
+			__m128i x = _mm_loadu_si128((__m128i const *)p);
+			__m128i m;
+			if (mode == Json) {
+				__m128i ctrl = _mm_cmpeq_epi8(_mm_max_epu8(x, _mm_set1_epi8(0x1f)), _mm_set1_epi8(0x1f));
+				m = _mm_or_si128(ctrl, _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))));
+			} else {
+				m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('&')), _mm_cmpeq_epi8(x, _mm_set1_epi8('<')));
+				m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8('>')));
+				m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\''))));
+			}
+			int bits = _mm_movemask_epi8(m);
+			if (bits) return p + misc::ctz32(bits);
+			p += 16;
+		}
+#endif
+		while (p < end && replace((unsigned char)*p, mode, nullptr) == 0) {
+			p++;
+		}
+		return p;
+	}
+
+	/**
+	 * @brief Replacement of `c`, written to `out` unless null.
+	 *
+	 * @return Its length, or 0 if `c` is copied as it is.
+	 */
+	static int replace(unsigned char c, Mode mode, char *out)
+	{
+		char const *r;
+		int n;
+		char tmp[6];
+		if (mode == Json) {
+			switch (c) {
+			case '"':  r = "\\\""; n = 2; break;
+			case '\\': r = "\\\\"; n = 2; break;
+			case '\b': r = "\\b"; n = 2; break;
+			case '\f': r = "\\f"; n = 2; break;
+			case '\n': r = "\\n"; n = 2; break;
+			case '\r': r = "\\r"; n = 2; break;
+			case '\t': r = "\\t"; n = 2; break;
+			default:
+				if (c >= 0x20) return 0;
+				memcpy(tmp, "\\u00", 4);
+				tmp[4] = "0123456789abcdef"[c >> 4];
+				tmp[5] = "0123456789abcdef"[c & 15];
+				r = tmp;
+				n = 6;
+				break;
+			}
+		} else {
+			switch (c) {
+			case '&':  r = "&amp;";  n = 5; break;
+			case '<':  r = "&lt;";   n = 4; break;
+			case '>':  r = "&gt;";   n = 4; break;
+			case '"':  r = "&quot;"; n = 6; break;
+			case '\'': r = "&#39;";  n = 5; break;
+			default:
+				return 0;
+			}
+		}
+		if (out) {
+			memcpy(out, r, n);
+		}
+		return n;
+	}
+
+	/**
+	 * @brief Length of `len` bytes at `p` once escaped.
+	 */
+	static size_t size(char const *p, size_t len, Mode mode)
+	{
+		char const *end = p + len;
+		size_t n = len;
+		while ((p = find(p, end, mode)) < end) {
+			n += replace((unsigned char)*p++, mode, nullptr) - 1;
+		}
+		return n;
+	}
+
+	/**
+	 * @brief Copy `len` bytes at `p` to `dst`, escaping as needed.
+	 *
+	 * @return Pointer past the last byte written.
+	 */
+	static char *copy(char *dst, char const *p, size_t len, Mode mode)
+	{
+		char const *end = p + len;
+		while (1) {
+			char const *q = find(p, end, mode);
+			memcpy(dst, p, q - p);
+			dst += q - p;
+			if (q == end) break;
+			dst += replace((unsigned char)*q, mode, dst);
+			p = q + 1;
+		}
+		return dst;
+	}
+};
+
+/**
+ * @brief Base64 encoding for "%y" (RFC 4648, padded) and "%Y" (base64url,
+ *        unpadded).
+ */
+class base64 {
+public:
+	/**
+	 * @brief Encoded length of `n` bytes.
+	 */
+	static size_t size(size_t n, bool pad)
+	{
+		return pad ? (n + 2) / 3 * 4 : n / 3 * 4 + (n % 3 == 0 ? 0 : n % 3 + 1);
+	}
+
+	/**
+	 * @brief Encode `n` bytes at `data` into `dst`, which must hold size(n, pad)
+	 *        bytes.
+	 *
+	 * With SSSE3, 12 bytes are encoded at a time as in Muła and Lemire,
+	 * "Faster Base64 Encoding and Decoding Using AVX2 Instructions".
+	 *
+	 * @return Pointer past the last character written.
+	 */
+	static char *encode(char *dst, void const *data, size_t n, bool url, bool pad)
+	{
+		uint8_t const *src = (uint8_t const *)data;
+		char const *table = url
+			? "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+			: "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		size_t i = 0;
+#ifdef STRFORMAT_SSSE3
+		__m128i shift = url
+			? _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '-' - 62, '_' - 63, 'A', 0, 0)
+			: _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+		for (; i + 16 <= n; i += 12) {
+			// spread 12 bytes into 16 lanes of 6 bits
+			__m128i in = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(src + i)), _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+			__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+			__m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+			__m128i idx = _mm_or_si128(t0, t1);
+			// offset to the character by range: 0-25, 26-51, 52-61, 62, 63
+			__m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+			r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+			_mm_storeu_si128((__m128i *)dst, _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx));
+			dst += 16;
+		}
+#endif
+		for (; i + 3 <= n; i += 3) {
+			uint32_t v = (uint32_t)src[i] << 16 | (uint32_t)src[i + 1] << 8 | src[i + 2];
+			dst[0] = table[v >> 18];
+			dst[1] = table[(v >> 12) & 63];
+			dst[2] = table[(v >> 6) & 63];
+			dst[3] = table[v & 63];
+			dst += 4;
+		}
+		if (i < n) {
+			uint32_t v = (uint32_t)src[i] << 16 | (i + 1 < n ? (uint32_t)src[i + 1] << 8 : 0);
+			*dst++ = table[v >> 18];
+			*dst++ = table[(v >> 12) & 63];
+			if (i + 1 < n) {
+				*dst++ = table[(v >> 6) & 63];
+			} else if (pad) {
+				*dst++ = '=';
+			}
+			if (pad) {
+				*dst++ = '=';
+			}
+		}
+		return dst;
+	}
+};
+
+#ifdef STRFORMAT_PROFILE
+/**
+ * @brief Optional per-phase timers for string_formatter.
+ *
+ * Enabled by defining STRFORMAT_PROFILE.  Every formatter phase (literal
+ * scanning, spec parsing, conversion, padding and rendering) is timed with
+ * rdtsc where available, `clock_gettime(CLOCK_MONOTONIC)` otherwise, and
+ * the elapsed ticks are accumulated in a log2 histogram owned by the
+ * calling thread.  Only the owning thread writes to its histogram, so
+ * recording never takes a lock; `dump()` can be called from any thread to
+ * sum up all histograms.
+ */
+class profiler {
+public:
+	enum Phase {
+		Scan,		// literal scanning in advance()
+		Parse,		// spec parsing in format()
+		Convert,	// type conversion (format_double, format_int64, ...)
+		Pad,		// padding
+		Render,		// render()
+		PhaseCount,
+	};
+	constexpr static int bucket_count = 64;
+	struct Summary {
+		uint64_t count[PhaseCount][bucket_count] = {};
+		uint64_t total[PhaseCount] = {};
+	};
+private:
+	struct Histogram {
+		std::atomic<uint64_t> count[PhaseCount][bucket_count];
+		std::atomic<uint64_t> total[PhaseCount];
+		Histogram *next;
+	};
+	static std::atomic<Histogram *> &histograms()
+	{
+		static std::atomic<Histogram *> head{nullptr};
+		return head;
+	}
+	static Histogram *attach()
+	{
+		// histograms are never freed so that dump() stays valid after thread exit
+		Histogram *h = new Histogram();
+		h->next = histograms().load(std::memory_order_relaxed);
+		while (!histograms().compare_exchange_weak(h->next, h, std::memory_order_release, std::memory_order_relaxed));
+		return h;
+	}
+	static Histogram *local()
+	{
+		thread_local Histogram *h = attach();
+		return h;
+	}
+	static int bucket(uint64_t ticks)
+	{
+		int i = 0;
+		while (ticks > 1 && i < bucket_count - 1) {
+			ticks >>= 1;
+			i++;
+		}
+		return i;
+	}
+	static void increment(std::atomic<uint64_t> &v, uint64_t n)
+	{
+		// single writer: a relaxed load/store pair is enough
+		v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+public:
+	static uint64_t now()
+	{
+#ifdef STRFORMAT_PROFILE_RDTSC
+		return __rdtsc();
+#else
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+	}
+	static char const *unit()
+	{
+#ifdef STRFORMAT_PROFILE_RDTSC
+		return "cycles";
+#else
+		return "ns";
+#endif
+	}
+	static char const *phase_name(int phase)
+	{
+		static char const *names[] = { "scan", "parse", "convert", "pad", "render" };
+		return (phase >= 0 && phase < PhaseCount) ? names[phase] : "?";
+	}
+	static void record(Phase phase, uint64_t ticks)
+	{
+		Histogram *h = local();
+		increment(h->count[phase][bucket(ticks)], 1);
+		increment(h->total[phase], ticks);
+	}
+	static Summary collect()
+	{
+		Summary s;
+		for (Histogram *h = histograms().load(std::memory_order_acquire); h; h = h->next) {
+			for (int i = 0; i < PhaseCount; i++) {
+				for (int j = 0; j < bucket_count; j++) {
+					s.count[i][j] += h->count[i][j].load(std::memory_order_relaxed);
+				}
+				s.total[i] += h->total[i].load(std::memory_order_relaxed);
+			}
+		}
+		return s;
+	}
+	static void clear()
+	{
+		for (Histogram *h = histograms().load(std::memory_order_acquire); h; h = h->next) {
+			for (int i = 0; i < PhaseCount; i++) {
+				for (int j = 0; j < bucket_count; j++) {
+					h->count[i][j].store(0, std::memory_order_relaxed);
+				}
+				h->total[i].store(0, std::memory_order_relaxed);
+			}
+		}
+	}
+	static void dump(FILE *fp)
+	{
+		Summary s = collect();
+		for (int i = 0; i < PhaseCount; i++) {
+			uint64_t n = 0;
+			for (int j = 0; j < bucket_count; j++) {
+				n += s.count[i][j];
+			}
+			fprintf(fp, "%-8s count=%llu total=%llu %s", phase_name(i), (unsigned long long)n, (unsigned long long)s.total[i], unit());
+			if (n > 0) {
+				fprintf(fp, " mean=%.1f", (double)s.total[i] / n);
+			}
+			fputc('\n', fp);
+			for (int j = 0; j < bucket_count; j++) {
+				if (s.count[i][j]) {
+					fprintf(fp, "  < 2^%-2d %llu\n", j + 1, (unsigned long long)s.count[i][j]);
+				}
+			}
+		}
+	}
+	class Scope {
+	private:
+		Phase phase_;
+		uint64_t start_;
+	public:
+		Scope(Phase phase)
+			: phase_(phase)
+			, start_(now())
+		{
+		}
+		~Scope()
+		{
+			record(phase_, now() - start_);
+		}
+	};
+};
+#define STRFORMAT_PROFILE_SCOPE(phase) strformat_ns::profiler::Scope strformat_profile_##phase(strformat_ns::profiler::phase)
+#else
+#define STRFORMAT_PROFILE_SCOPE(phase) ((void)0)
+#endif
+
+struct NumberParser {
+	char const *p;
+	bool sign = false;
+	int radix = 10;
+	NumberParser(char const *ptr)
+		: p(ptr)
+	{
+		while (isspace((unsigned char)*p)) {
+			p++;
+		}
+		if (*p == '+') {
+			p++;
+		} else if (*p == '-') {
+			sign = true;
+			p++;
+		}
+		if (p[0] == '0') {
+			if (p[1] == 'x' || p[1] == 'X') {
+				p += 2;
+				radix = 16;
+			} else {
+				int i = 1;
+				while (p[i]) {
+					int c = (unsigned char)p[i];
+					if (c < '0' || c > '7') break;
+					radix = 8;
+					i++;
+				}
+			}
+		}
+	}
+};
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable: 4146) // unary minus operator applied to unsigned type, result still unsigned
+#endif
+
+template <typename T> static inline T parse_number(char const *ptr, std::function<T(char const *p, int radix)> conv)
+{
+	NumberParser t(ptr);
+	T v = conv(t.p, t.radix);
+	if (t.sign) v = -v;
+	return v;
+}
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+/**
+ * @brief Immutable snapshot of the numeric locale.
+ *
+ * `localeconv()` is neither cheap nor thread-safe, so the decimal point,
+ * thousands separator and grouping are captured once and shared by any
+ * number of formatters.  A snapshot of the "C" locale is detected at
+ * capture time so that formatting can skip all locale work for it.
+ */
+class locale_snapshot {
+private:
+	std::string decimal_point_ = ".";
+	std::string thousands_sep_;
+	std::string grouping_;
+	bool c_locale_ = true;
+	int separators(int digits) const
+	{
+		int n = 0;
+		size_t i = 0;
+		int g = 0;
+		while (1) {
+			if (i < grouping_.size()) g = grouping_[i++]; // the last size repeats
+			if (g <= 0 || g == CHAR_MAX || g >= digits) break;
+			digits -= g;
+			n++;
+		}
+		return n;
+	}
+public:
+	locale_snapshot() = default;
+	locale_snapshot(std::string decimal_point, std::string thousands_sep, std::string grouping)
+		: decimal_point_(decimal_point.empty() ? std::string(".") : decimal_point)
+		, thousands_sep_(thousands_sep)
+		, grouping_(grouping)
+	{
+		c_locale_ = decimal_point_ == "." && (thousands_sep_.empty() || grouping_.empty());
+	}
+
+	/**
+	 * @brief Capture the current numeric locale.
+	 */
+	static locale_snapshot capture()
+	{
+#ifndef STRFORMAT_NO_LOCALE
+		struct lconv *lc = localeconv();
+		if (lc) {
+			return locale_snapshot(lc->decimal_point ? lc->decimal_point : "", lc->thousands_sep ? lc->thousands_sep : "", lc->grouping ? lc->grouping : "");
+		}
+#endif
+		return {};
+	}
+
+	/**
+	 * @brief Process-wide snapshot, captured on first use.
+	 *
+	 * Programs that call `setlocale()` later should capture their own
+	 * snapshot and hand it to the formatters with `set_locale()`.
+	 */
+	static locale_snapshot const &global()
+	{
+		static const locale_snapshot snapshot = capture();
+		return snapshot;
+	}
+
+	std::string const &decimal_point() const
+	{
+		return decimal_point_;
+	}
+	std::string const &thousands_sep() const
+	{
+		return thousands_sep_;
+	}
+	std::string const &grouping() const
+	{
+		return grouping_;
+	}
+	bool is_c() const
+	{
+		return c_locale_;
+	}
+
+	/**
+	 * @brief Upper bound of the size of localize() output.
+	 */
+	size_t localized_size(size_t len) const
+	{
+		return len * (thousands_sep_.size() + 1) + decimal_point_.size();
+	}
+
+	/**
+	 * @brief Rewrite a formatted number for this locale.
+	 *
+	 * [begin, end) holds an optional sign, integer digits and an optional
+	 * '.' followed by the fraction.  The '.' is replaced by the decimal
+	 * point and, if `group` is set, thousands separators are inserted.
+	 *
+	 * @return Pointer past the last byte written.
+	 */
+	char *localize(char *dst, char const *begin, char const *end, bool group) const
+	{
+		char const *p = begin;
+		while (p < end && !isdigit((unsigned char)*p)) {
+			*dst++ = *p++;
+		}
+		char const *q = p;
+		while (q < end && isdigit((unsigned char)*q)) {
+			q++;
+		}
+		int digits = int(q - p);
+		int n = group && !thousands_sep_.empty() ? separators(digits) : 0;
+		char *out = dst + digits + n * thousands_sep_.size();
+		char *e = out;
+		size_t i = 0;
+		int g = 0;
+		for (int k = 0; k < n; k++) {
+			if (i < grouping_.size()) g = grouping_[i++];
+			for (int j = 0; j < g; j++) {
+				*--e = *--q;
+			}
+			e -= thousands_sep_.size();
+			memcpy(e, thousands_sep_.data(), thousands_sep_.size());
+		}
+		while (q > p) {
+			*--e = *--q;
+		}
+		p += digits;
+		if (p < end && *p == '.') {
+			memcpy(out, decimal_point_.data(), decimal_point_.size());
+			out += decimal_point_.size();
+			p++;
+		}
+		while (p < end) {
+			*out++ = *p++;
+		}
+		return out;
 	}
 };
 
-struct NumberParser {
-	char const *p;
-	bool sign = false;
-	int radix = 10;
-	NumberParser(char const *ptr)
-		: p(ptr)
+struct Option_ {
+	locale_snapshot const *loc = nullptr;
+};
+
+template <typename T> static inline T num(char const *value, Option_ const &opt);
+template <> inline char num<char>(char const *value, Option_ const &opt)
+{
+	(void)opt;
+	return parse_number<char>(value, [](char const *p, int radix){
+		return (char)strtol(p, nullptr, radix);
+	});
+}
+template <> inline int32_t num<int32_t>(char const *value, Option_ const &opt)
+{
+	(void)opt;
+	return parse_number<int32_t>(value, [](char const *p, int radix){
+		return strtol(p, nullptr, radix);
+	});
+}
+template <> inline uint32_t num<uint32_t>(char const *value, Option_ const &opt)
+{
+	(void)opt;
+	return parse_number<uint32_t>(value, [](char const *p, int radix){
+		return strtoul(p, nullptr, radix);
+	});
+}
+template <> inline int64_t num<int64_t>(char const *value, Option_ const &opt)
+{
+	(void)opt;
+	return parse_number<int64_t>(value, [](char const *p, int radix){
+		return strtoll(p, nullptr, radix);
+	});
+}
+template <> inline uint64_t num<uint64_t>(char const *value, Option_ const &opt)
+{
+	(void)opt;
+	return parse_number<uint64_t>(value, [](char const *p, int radix){
+		return strtoull(p, nullptr, radix);
+	});
+}
+#ifndef STRFORMAT_NO_FP
+template <> inline double num<double>(char const *value, Option_ const &opt)
+{
+	return parse_number<double>(value, [&opt](char const *p, int radix){
+		if (radix == 10) {
+			if (opt.loc) {
+				// locale-dependent
+				return strtod(p, nullptr);
+			} else {
+				// locale-independent
+				return misc::my_strtod(p, nullptr);
+			}
+		} else if (radix == 16) {
+			return misc::parse_hexfloat(p, nullptr);
+		} else {
+			return (double)strtoll(p, nullptr, radix);
+		}
+	});
+}
+#endif
+template <typename T> static inline T num(std::string const &value, Option_ const &opt)
+{
+	return num<T>(value.data(), opt);
+}
+
+/**
+ * @brief Parsed conversion specification such as "%-08.3lX".
+ */
+struct format_spec {
+	bool upper = false;
+	bool zero_padding = false;
+	bool align_left = false;
+	bool plus = false;
+	bool grouping = false;
+	bool alt = false;	// '#'
+	int width = -1;		// -1: taken from the argument
+	int precision = -1;	// -1: taken from the argument
+	int lflag = 0;
+	int conv = 0;		// lower-cased conversion character, not a letter if missing
+
+	/**
+	 * @brief Parse the specification that starts at the '%' at `p`.
+	 *
+	 * Reading stops at `end`; the text need not be NUL-terminated.
+	 *
+	 * @return Pointer past the specification.  The conversion character is
+	 *         consumed only if it is a letter.
+	 */
+	static char const *parse(char const *p, char const *end, format_spec *spec)
 	{
-		while (isspace((unsigned char)*p)) {
+		auto Peek = [&](){
+			return p < end ? (unsigned char)*p : 0;
+		};
+
+		if (Peek() == '%') {
 			p++;
 		}
-		if (*p == '+') {
+
+		while (1) {
+			int c = Peek();
+			if (c == '0') {
+				spec->zero_padding = true;
+			} else if (c == '+') {
+				spec->plus = true;
+			} else if (c == '-') {
+				spec->align_left = true;
+			} else if (c == '\'') {
+				spec->grouping = true;
+			} else if (c == '#') {
+				spec->alt = true;
+			} else {
+				break;
+			}
 			p++;
-		} else if (*p == '-') {
-			sign = true;
+		}
+
+		auto GetNumber = [&](){
+			int value = -1;
+			if (Peek() == '*') {
+				p++;
+			} else {
+				while (1) {
+					int c = Peek();
+					if (!isdigit(c)) break;
+					if (value < 0) {
+						value = 0;
+					} else {
+						value *= 10;
+					}
+					value += c - '0';
+					p++;
+				}
+			}
+			return value;
+		};
+
+		spec->width = GetNumber();
+
+		if (Peek() == '.') {
 			p++;
 		}
-		if (p[0] == '0') {
-			if (p[1] == 'x' || p[1] == 'X') {
-				p += 2;
-				radix = 16;
+
+		spec->precision = GetNumber();
+
+		while (Peek() == 'l') {
+			spec->lflag++;
+			p++;
+		}
+
+		int c = Peek();
+		if (isupper(c)) {
+			spec->upper = true;
+			c = tolower(c);
+		}
+		if (isalpha(c)) {
+			p++;
+		}
+		spec->conv = c;
+		return p;
+	}
+};
+
+/**
+ * @brief Process-wide registry of parsed format strings.
+ *
+ * A format string is split once into literal runs and specifications,
+ * exactly as the formatter would scan it, and the result is shared by
+ * every formatter built on the same text.  Lookups are keyed by the text
+ * pointer, so only immutable text (string literals) may be registered:
+ * either explicitly with intern(), or on first use with the Intern flag.
+ * The same text at a different address (the same literal in another
+ * translation unit) is found through a content hash and shares the entry.
+ *
+ * Only formatters built with the Intern flag consult the registry; any other
+ * text is parsed as usual even if the same pointer has been registered.
+ *
+ * Readers never lock: entries are published with a compare-and-swap into
+ * fixed-size open-addressed tables and are never freed.  Once the memory
+ * limit is reached, new strings are simply parsed as usual.  Each thread
+ * counts its hits and misses in a block of its own, like the profiler's
+ * histograms, so lookups write no shared data; hits() and misses() sum up
+ * the blocks of all threads.
+ */
+class format_registry {
+public:
+	struct Token {
+		uint32_t offset;	// into the text
+		uint32_t length;	// bytes to emit as literal text (for a spec: its raw text)
+		bool is_spec;
+		format_spec spec;
+	};
+	struct Compiled {
+		uint64_t hash;
+		size_t size;
+		char const *text;
+		size_t count;
+		Token tokens[1];
+	};
+private:
+	constexpr static size_t table_size = 4096;
+	struct Alias {
+		char const *text;
+		size_t size;
+		Compiled const *compiled;
+	};
+	struct State {
+		std::atomic<Alias *> by_pointer[table_size];
+		std::atomic<Compiled *> by_content[table_size];
+		std::atomic<size_t> entries{0};
+		std::atomic<size_t> bytes{0};
+		std::atomic<size_t> limit{1024 * 1024};
+	};
+	struct alignas(64) Counters {
+		std::atomic<uint64_t> hits;
+		std::atomic<uint64_t> misses;
+		Counters *next;
+	};
+	static State &state()
+	{
+		static State st;
+		return st;
+	}
+	static std::atomic<Counters *> &counter_list()
+	{
+		static std::atomic<Counters *> head{nullptr};
+		return head;
+	}
+	static Counters *attach()
+	{
+		// blocks are never freed so that the counts outlive their thread
+		Counters *c = new Counters();
+		c->next = counter_list().load(std::memory_order_relaxed);
+		while (!counter_list().compare_exchange_weak(c->next, c, std::memory_order_release, std::memory_order_relaxed));
+		return c;
+	}
+	static Counters &counters()
+	{
+		thread_local Counters *c = attach();
+		return *c;
+	}
+	static void increment(std::atomic<uint64_t> &v)
+	{
+		// single writer: a relaxed load/store pair is enough
+		v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+	static uint64_t sum(std::atomic<uint64_t> Counters::*member)
+	{
+		uint64_t n = 0;
+		for (Counters *c = counter_list().load(std::memory_order_acquire); c; c = c->next) {
+			n += (c->*member).load(std::memory_order_relaxed);
+		}
+		return n;
+	}
+	static uint64_t hash(std::string_view text)
+	{
+		uint64_t h = 14695981039346656037ULL; // FNV-1a
+		for (unsigned char c : text) {
+			h = (h ^ c) * 1099511628211ULL;
+		}
+		return h;
+	}
+	static size_t pointer_slot(char const *p)
+	{
+		return size_t(((uint64_t)(uintptr_t)p * 0x9e3779b97f4a7c15ULL) >> 40) % table_size;
+	}
+	static bool reserve(size_t n)
+	{
+		State &st = state();
+		size_t used = st.bytes.load(std::memory_order_relaxed);
+		do {
+			if (used + n > st.limit.load(std::memory_order_relaxed)) return false;
+		} while (!st.bytes.compare_exchange_weak(used, used + n, std::memory_order_relaxed));
+		return true;
+	}
+	static Compiled *compile(std::string_view text, uint64_t h)
+	{
+		std::vector<Token> tokens;
+		char const *begin = text.data();
+		char const *end = begin + text.size();
+		char const *head = begin;
+		char const *next = begin;
+		auto Literal = [&](){
+			if (head < next) {
+				tokens.push_back({ uint32_t(head - begin), uint32_t(next - head), false, {} });
+				head = next;
+			}
+		};
+		// same scan as string_formatter::advance()
+		while (next < end) {
+			next = misc::find_percent(next, end);
+			if (next == end) break;
+			if (next + 1 < end && next[1] == '%') {
+				next++;
+				Literal();
+				next++;
+				head = next;
 			} else {
-				int i = 1;
-				while (p[i]) {
-					int c = (unsigned char)p[i];
-					if (c < '0' || c > '7') break;
-					radix = 8;
-					i++;
+				Literal();
+				Token t = { uint32_t(next - begin), 0, true, {} };
+				next = format_spec::parse(next, end, &t.spec);
+				t.length = uint32_t(next - begin) - t.offset;
+				tokens.push_back(t);
+				head = next;
+			}
+		}
+		Literal();
+
+		size_t bytes = sizeof(Compiled) + tokens.size() * sizeof(Token);
+		if (!reserve(bytes)) return nullptr;
+		Compiled *c = (Compiled *)::malloc(bytes);
+		c->hash = h;
+		c->size = text.size();
+		c->text = text.data();
+		c->count = tokens.size();
+		std::copy(tokens.begin(), tokens.end(), c->tokens);
+		return c;
+	}
+	static Compiled const *find_content(std::string_view text, uint64_t h, bool insert)
+	{
+		State &st = state();
+		Compiled *c = nullptr;
+		for (size_t i = 0; i < table_size; i++) {
+			std::atomic<Compiled *> &slot = st.by_content[(h + i) % table_size];
+			Compiled *e = slot.load(std::memory_order_acquire);
+			if (!e) {
+				if (!insert) return nullptr;
+				if (!c) {
+					c = compile(text, h);
+					if (!c) return nullptr;
+				}
+				if (slot.compare_exchange_strong(e, c, std::memory_order_acq_rel)) {
+					st.entries.fetch_add(1, std::memory_order_relaxed);
+					return c;
+				}
+				// lost the race: e is the winner, compare it below
+			}
+			if (e->hash == h && e->size == text.size() && memcmp(e->text, text.data(), text.size()) == 0) {
+				if (c) {
+					st.bytes.fetch_sub(sizeof(Compiled) + c->count * sizeof(Token), std::memory_order_relaxed);
+					::free(c);
 				}
+				return e;
+			}
+		}
+		if (c) {
+			st.bytes.fetch_sub(sizeof(Compiled) + c->count * sizeof(Token), std::memory_order_relaxed);
+			::free(c);
+		}
+		return nullptr;
+	}
+public:
+	/**
+	 * @brief Look up the parsed form of `text`, registering it if needed.
+	 *
+	 * @return nullptr if the registry is full.
+	 */
+	static Compiled const *find(std::string_view text)
+	{
+		State &st = state();
+		size_t i = pointer_slot(text.data());
+		for (size_t n = 0; n < table_size; n++, i = (i + 1) % table_size) {
+			Alias *a = st.by_pointer[i].load(std::memory_order_acquire);
+			if (!a) break;
+			if (a->text == text.data() && a->size == text.size()) {
+				increment(counters().hits);
+				return a->compiled;
+			}
+		}
+		increment(counters().misses);
+
+		Compiled const *c = find_content(text, hash(text), true);
+		if (!c || !reserve(sizeof(Alias))) return c;
+		Alias *a = (Alias *)::malloc(sizeof(Alias));
+		*a = { text.data(), text.size(), c };
+		for (size_t n = 0; n < table_size; n++, i = (i + 1) % table_size) {
+			Alias *e = nullptr;
+			if (st.by_pointer[i].compare_exchange_strong(e, a, std::memory_order_acq_rel)) {
+				return c;
 			}
 		}
+		st.bytes.fetch_sub(sizeof(Alias), std::memory_order_relaxed);
+		::free(a);
+		return c;
+	}
+
+	/**
+	 * @brief Register an immutable format string ahead of its first use.
+	 */
+	static bool intern(std::string_view text)
+	{
+		return find(text) != nullptr;
+	}
+
+	/**
+	 * @brief Lookups by all threads that found / had to register the text.
+	 */
+	static uint64_t hits()
+	{
+		return sum(&Counters::hits);
+	}
+	static uint64_t misses()
+	{
+		return sum(&Counters::misses);
+	}
+	/**
+	 * @brief hits() of the calling thread only.
+	 */
+	static uint64_t this_thread_hits()
+	{
+		return counters().hits.load(std::memory_order_relaxed);
+	}
+	static size_t memory_usage()
+	{
+		return state().bytes.load(std::memory_order_relaxed);
+	}
+	static void set_limit(size_t bytes)
+	{
+		state().limit.store(bytes, std::memory_order_relaxed);
+	}
+};
+
+/**
+ * @brief Minimal bump allocator over a caller-supplied buffer.
+ *
+ * Strings rendered into it with str(bump_arena *) are all released at once
+ * by reset().
+ */
+class bump_arena {
+private:
+	char *begin_;
+	char *ptr_;
+	char *end_;
+public:
+	bump_arena(void *buffer, size_t size)
+		: begin_((char *)buffer)
+		, ptr_((char *)buffer)
+		, end_((char *)buffer + size)
+	{
+	}
+	/**
+	 * @return nullptr if the arena is exhausted.
+	 */
+	char *allocate(size_t size)
+	{
+		if (size > size_t(end_ - ptr_)) return nullptr;
+		char *p = ptr_;
+		ptr_ += size;
+		return p;
+	}
+	void reset()
+	{
+		ptr_ = begin_;
+	}
+	size_t used() const
+	{
+		return ptr_ - begin_;
+	}
+	size_t capacity() const
+	{
+		return end_ - begin_;
+	}
+};
+
+/**
+ * @brief String with inline storage, returned by fixed_str().
+ *
+ * Text beyond the capacity is dropped and flagged by truncated().
+ */
+template <size_t N> class fixed_string {
+private:
+	size_t size_ = 0;
+	bool truncated_ = false;
+	char data_[N + 1];
+public:
+	fixed_string()
+	{
+		data_[0] = 0;
+	}
+	void append(char const *ptr, size_t len)
+	{
+		if (len > N - size_) {
+			len = N - size_;
+			truncated_ = true;
+		}
+		memcpy(data_ + size_, ptr, len);
+		size_ += len;
+		data_[size_] = 0;
+	}
+	void append(size_t len, char c)
+	{
+		if (len > N - size_) {
+			len = N - size_;
+			truncated_ = true;
+		}
+		memset(data_ + size_, c, len);
+		size_ += len;
+		data_[size_] = 0;
+	}
+	char const *data() const
+	{
+		return data_;
+	}
+	char const *c_str() const
+	{
+		return data_;
+	}
+	size_t size() const
+	{
+		return size_;
+	}
+	bool empty() const
+	{
+		return size_ == 0;
+	}
+	bool truncated() const
+	{
+		return truncated_;
+	}
+	std::string_view view() const
+	{
+		return std::string_view(data_, size_);
+	}
+	operator std::string_view () const
+	{
+		return view();
 	}
 };
 
-#ifdef _MSC_VER
-#pragma warning(push)
-#pragma warning(disable: 4146) // unary minus operator applied to unsigned type, result still unsigned
-#endif
+/**
+ * @brief String argument that is referenced instead of copied.
+ *
+ * The caller guarantees that the text stays alive until the formatter is
+ * rendered; its bytes are then copied once, straight into the output.
+ */
+struct borrowed {
+	std::string_view text;
+};
 
-template <typename T> static inline T parse_number(char const *ptr, std::function<T(char const *p, int radix)> conv)
-{
-	NumberParser t(ptr);
-	T v = conv(t.p, t.radix);
-	if (t.sign) v = -v;
-	return v;
-}
+/**
+ * @brief Binary buffer argument, printed in hex by "%h"/"%H".
+ *
+ * "%.Nh" puts `separator` between groups of N bytes, and "%#h" uses the
+ * layout of "hexdump -C".  "%y"/"%Y" encode the bytes in base64 and "%s"
+ * copies them as they are.
+ */
+struct byte_span {
+	void const *data;
+	size_t size;
+	char separator;
 
-#ifdef _MSC_VER
-#pragma warning(pop)
+	byte_span(void const *data, size_t size, char separator = ' ')
+		: data(data)
+		, size(size)
+		, separator(separator)
+	{
+	}
+#if __cplusplus >= 202002L && __has_include(<span>)
+	byte_span(std::span<std::byte const> bytes, char separator = ' ')
+		: byte_span(bytes.data(), bytes.size(), separator)
+	{
+	}
 #endif
+};
 
-struct Option_ {
-#ifdef STRFORMAT_NO_LOCALE
-	void *lc = nullptr;
-#else
-	struct lconv *lc = nullptr;
-#endif
+/**
+ * @brief Point in time for "%t"/"%T".
+ *
+ * "%t" prints ISO 8601 local to `offset_minutes` ("2025-01-02T03:04:05"),
+ * "%T" adds the zone ("Z" or "+09:00"), and the precision selects 0 to 9
+ * fraction digits.  Other conversions print the nanosecond count.
+ */
+struct timestamp {
+	int64_t ns;				// since 1970-01-01T00:00:00Z
+	int offset_minutes;		// east of UTC
+
+	timestamp(int64_t ns, int offset_minutes = 0)
+		: ns(ns)
+		, offset_minutes(offset_minutes)
+	{
+	}
+	timestamp(std::chrono::system_clock::time_point tp, int offset_minutes = 0)
+		: ns(std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count())
+		, offset_minutes(offset_minutes)
+	{
+	}
 };
 
-template <typename T> static inline T num(char const *value, Option_ const &opt);
-template <> inline char num<char>(char const *value, Option_ const &opt)
-{
-	(void)opt;
-	return parse_number<char>(value, [](char const *p, int radix){
-		return (char)strtol(p, nullptr, radix);
-	});
-}
-template <> inline int32_t num<int32_t>(char const *value, Option_ const &opt)
-{
-	(void)opt;
-	return parse_number<int32_t>(value, [](char const *p, int radix){
-		return strtol(p, nullptr, radix);
-	});
-}
-template <> inline uint32_t num<uint32_t>(char const *value, Option_ const &opt)
-{
-	(void)opt;
-	return parse_number<uint32_t>(value, [](char const *p, int radix){
-		return strtoul(p, nullptr, radix);
-	});
-}
-template <> inline int64_t num<int64_t>(char const *value, Option_ const &opt)
-{
-	(void)opt;
-	return parse_number<int64_t>(value, [](char const *p, int radix){
-		return strtoll(p, nullptr, radix);
-	});
-}
-template <> inline uint64_t num<uint64_t>(char const *value, Option_ const &opt)
-{
-	(void)opt;
-	return parse_number<uint64_t>(value, [](char const *p, int radix){
-		return strtoull(p, nullptr, radix);
-	});
-}
-#ifndef STRFORMAT_NO_FP
-template <> inline double num<double>(char const *value, Option_ const &opt)
-{
-	return parse_number<double>(value, [&opt](char const *p, int radix){
-		if (radix == 10) {
-			if (opt.lc) {
-				// locale-dependent
-				return strtod(p, nullptr);
-			} else {
-				// locale-independent
-				return misc::my_strtod(p, nullptr);
-			}
-		} else {
-			return (double)strtoll(p, nullptr, radix);
-		}
-	});
-}
-#endif
-template <typename T> static inline T num(std::string const &value, Option_ const &opt)
-{
-	return num<T>(value.data(), opt);
-}
+/**
+ * @brief Scaled integer, `value` / 10^`scale`, such as cents (scale 2).
+ *
+ * Every conversion prints it as an exact decimal with the precision of the
+ * specification, or `scale` digits if omitted, like "%f".
+ */
+struct decimal {
+	int64_t value;
+	int scale;		// 0 to 18
 
-class string_formatter {
+	decimal(int64_t value, int scale)
+		: value(value)
+		, scale(scale)
+	{
+	}
+};
+
+template <typename Allocator> class basic_string_formatter {
 public:
 	enum Flags {
 		Locale = 0x0001,
+		Utf8 = 0x0002,				// %s width and precision count code points
+		EastAsianWidth = 0x0004,	// with Utf8: count display columns (UAX #11)
+		ReplaceInvalid = 0x0008,	// with Utf8: replace ill-formed sequences with U+FFFD
+		Intern = 0x0010,			// the text is immutable: cache its parsed form process-wide
 	};
 private:
-#if 0
-	StdAlloc allocator;
-#else
-	QuickAlloc allocator;
-#endif
+	Allocator allocator;
 	void *x_alloc(size_t size)
 	{
-		return allocator.alloc(size);
+		// once an allocation fails nothing more is added, so the output is truncated
+		void *p = q.overflow ? nullptr : allocator.alloc(size);
+		if (!p) q.overflow = true;
+		return p;
 	}
 	void x_free(void *ptr)
 	{
@@ -402,22 +2905,71 @@ private:
 private:
 	struct Part {
 		Part *next;
+		char const *ptr;	// points to data, or to external memory for referenced parts
 		int size;
+		int fill_len;		// padding run, expanded only when the output is written
+		char fill;
+		char sign;			// zero padding moves the sign in front of the run
+		bool fill_after;	// left-aligned: the run follows the text
+		int capacity;		// bytes of inline data
 		char data[1];
 	};
 	struct PartList {
 		Part *head = nullptr;
 		Part *last = nullptr;
 	};
-	Part *alloc_part(const char *data, int size)
+	Part *new_part(size_t bytes)
 	{
-		Part *p = (Part *)x_alloc(sizeof(Part) + size);
+		Part *p = (Part *)x_alloc(bytes);
+		if (!p) return nullptr;
 		p->next = nullptr;
+		p->ptr = p->data;
+		p->size = 0;
+		p->fill_len = 0;
+		p->fill = ' ';
+		p->sign = 0;
+		p->fill_after = false;
+		p->capacity = int(bytes - offsetof(Part, data));
+		return p;
+	}
+	/**
+	 * @brief Copy a part into this formatter's allocator.
+	 */
+	Part *copy_part(Part const *src)
+	{
+		Part *p = (Part *)x_alloc(offsetof(Part, data) + src->capacity);
+		if (!p) return nullptr;
+		memcpy((void *)p, src, offsetof(Part, data) + src->capacity);
+		p->next = nullptr;
+		if (src->capacity > 0 && src->ptr >= src->data && src->ptr <= src->data + src->capacity) {
+			p->ptr = p->data + (src->ptr - src->data);
+		}
+		return p;
+	}
+	Part *alloc_part(const char *data, int size)
+	{
+		Part *p = new_part(sizeof(Part) + size);
+		if (!p) return nullptr;
 		p->size = size;
-		memcpy(p->data, data, size);
+		if (size > 0) {
+			memcpy(p->data, data, size); // data may be null when empty
+		}
 		p->data[size] = 0;
 		return p;
 	}
+	/**
+	 * @brief Allocate a part that refers to external memory without copying.
+	 *
+	 * The referenced bytes must stay alive until the formatter is rendered.
+	 */
+	Part *alloc_ref(const char *data, int size)
+	{
+		Part *p = new_part(offsetof(Part, data));
+		if (!p) return nullptr;
+		p->ptr = data;
+		p->size = size;
+		return p;
+	}
 	Part *alloc_part(const char *begin, const char *end)
 	{
 		return alloc_part(begin, int(end - begin));
@@ -460,14 +3012,32 @@ private:
 		list->head = nullptr;
 		list->last = nullptr;
 	}
-	void add_chars(PartList *list, char c, int n)
+	static int part_length(Part const *p)
 	{
-		Part *p = (Part *)x_alloc(sizeof(Part) + n);
-		p->next = nullptr;
-		p->size = n;
-		memset(p->data, c, n);
-		p->data[n] = 0;
-		add_part(list, p);
+		return (p->sign ? 1 : 0) + p->fill_len + p->size;
+	}
+	/**
+	 * @brief Emit every part through a copy and a fill callback.
+	 *
+	 * Padding runs are handed to `fill` as (char, count) so that each sink
+	 * can expand them directly into its own storage.
+	 */
+	template <typename Copy, typename Fill> void render_parts(Copy const &copy, Fill const &fill)
+	{
+		advance(true);
+		STRFORMAT_PROFILE_SCOPE(Render);
+		for (Part *p = q.list.head; p; p = p->next) {
+			if (p->sign) {
+				copy(&p->sign, 1);
+			}
+			if (p->fill_len > 0 && !p->fill_after) {
+				fill(p->fill, p->fill_len);
+			}
+			copy(p->ptr, p->size);
+			if (p->fill_len > 0 && p->fill_after) {
+				fill(p->fill, p->fill_len);
+			}
+		}
 	}
 	//
 	static char const *digits_lower()
@@ -482,18 +3052,10 @@ private:
 #ifndef STRFORMAT_NO_FP
 	Part *format_double(double val, int precision, bool trim_zeros, bool plus)
 	{
-		if (std::isnan(val)) return alloc_part("#NAN");
-		if (std::isinf(val)) return alloc_part("#INF");
-
-		bool sign = val < 0;
-		if (sign) val = -val;
-
-		int bufsize = precision + 400;
-		char *buf = (char *)alloca(bufsize);
-		char *ptr = buf + 1; // reserve buf[0] for sign
-
-		auto result = std::to_chars(ptr, buf + bufsize, val, std::chars_format::fixed, precision);
-		char *end = result.ptr;
+		size_t size = misc::fixed_bound(val, precision);
+		char small[40];
+		char *ptr = size <= sizeof(small) ? small : (char *)alloca(size);
+		char *end = misc::write_fixed(ptr, ptr + size, val, precision, plus);
 
 		if (trim_zeros) {
 			char *dot = std::find(ptr, end, '.');
@@ -503,15 +3065,21 @@ private:
 			}
 		}
 
-		if (sign) {
-			*--ptr = '-';
-		} else if (plus) {
-			*--ptr = '+';
+		if (q.opt.loc && !q.opt.loc->is_c()) {
+			return localize(ptr, end);
 		}
 
 		return alloc_part(ptr, end);
 	}
 #endif
+	Part *localize(char const *begin, char const *end)
+	{
+		Part *p = new_part(sizeof(Part) + q.opt.loc->localized_size(end - begin));
+		if (!p) return nullptr;
+		p->size = int(q.opt.loc->localize(p->data, begin, end, q.grouping) - p->data);
+		p->data[p->size] = 0;
+		return p;
+	}
 	Part *format_int32(int32_t val, bool force_sign)
 	{
 		int n = 30;
@@ -525,7 +3093,7 @@ private:
 			bool sign = (val < 0);
 			uint32_t v;
 			if (sign) {
-				v = (uint32_t)-val;
+				v = 0u - (uint32_t)val;
 			} else {
 				v = (uint32_t)val;;
 			}
@@ -656,46 +3224,100 @@ private:
 	}
 	Part *format_hex32(uint32_t val, bool upper)
 	{
-		int n = 30;
-		char *end = (char *)alloca(n) + n - 1;
-		char *ptr = end;
-		*end = 0;
-
-		char const *digits = upper ? digits_upper() : digits_lower();
-
-		if (val == 0) {
-			*--ptr = '0';
-		} else {
-			while (val != 0) {
-				char c = digits[val & 15];
-				val >>= 4;
-				*--ptr = c;
-			}
-		}
-
-		return alloc_part(ptr, end);
+		char tmp[16];
+		char *end = misc::write_hex64(tmp, val, upper);
+		return alloc_part(tmp, end);
 	}
 	Part *format_hex64(uint64_t val, bool upper)
 	{
-		int n = 30;
-		char *end = (char *)alloca(n) + n - 1;
-		char *ptr = end;
-		*end = 0;
-
-		char const *digits = upper ? digits_upper() : digits_lower();
-
-		if (val == 0) {
-			*--ptr = '0';
-		} else {
-			while (val != 0) {
-				char c = digits[val & 15];
-				val >>= 4;
-				*--ptr = c;
-			}
+		char tmp[16];
+		char *end = misc::write_hex64(tmp, val, upper);
+		return alloc_part(tmp, end);
+	}
+	/**
+	 * @brief Binary digits; with the '\'' flag, '_' between groups of four.
+	 */
+	Part *format_bin(char const *begin, char const *end)
+	{
+		if (!q.grouping || end - begin <= 4) {
+			return alloc_part(begin, end);
 		}
-
+		int n = int(end - begin);
+		Part *p = new_part(sizeof(Part) + n + (n - 1) / 4);
+		if (!p) return nullptr;
+		char *dst = p->data;
+		int head = (n - 1) % 4 + 1;
+		memcpy(dst, begin, head);
+		dst += head;
+		for (char const *s = begin + head; s < end; s += 4) {
+			*dst++ = '_';
+			memcpy(dst, s, 4);
+			dst += 4;
+		}
+		p->size = int(dst - p->data);
+		p->data[p->size] = 0;
+		return p;
+	}
+	Part *format_bin32(uint32_t val)
+	{
+		return format_bin64(val);
+	}
+	Part *format_bin64(uint64_t val)
+	{
+		char tmp[64];
+		char *end = misc::write_bin64(tmp, val);
+		return format_bin(tmp, end);
+	}
+#ifdef STRFORMAT_INT128
+	Part *format_int128(int128_t val, bool force_sign)
+	{
+		char tmp[64];
+		char *ptr = tmp;
+		uint128_t mag = uint128_t(val);
+		if (val < 0) {
+			*ptr++ = '-';
+			mag = 0 - mag;
+		} else if (force_sign && val != 0) {
+			*ptr++ = '+';
+		}
+		char *end = misc::write_uint128(ptr, mag);
+		return alloc_part(tmp, end);
+	}
+	Part *format_uint128(uint128_t val)
+	{
+		char tmp[64];
+		char *end = misc::write_uint128(tmp, val);
+		return alloc_part(tmp, end);
+	}
+	Part *format_oct128(uint128_t val)
+	{
+		char tmp[48];
+		char *end = tmp + sizeof(tmp);
+		char *ptr = end;
+		do {
+			*--ptr = char('0' + (val & 7));
+			val >>= 3;
+		} while (val != 0);
 		return alloc_part(ptr, end);
 	}
+	Part *format_hex128(uint128_t val, bool upper)
+	{
+		char tmp[48];
+		char *end = misc::write_hex128(tmp, val, upper);
+		return alloc_part(tmp, end);
+	}
+	Part *format_bin128(uint128_t val)
+	{
+		char tmp[128];
+		char *end = tmp;
+		uint64_t hi = uint64_t(val >> 64);
+		if (hi != 0) {
+			end = misc::write_bin64(end, hi);
+		}
+		end = misc::write_bin64(end, uint64_t(val), hi != 0 ? 64 : 1);
+		return format_bin(tmp, end);
+	}
+#endif
 	Part *format_pointer(void *val)
 	{
 		int n = sizeof(uintptr_t) * 2 + 1;
@@ -724,46 +3346,89 @@ private:
 		bool zero_padding : 1;
 		bool align_left : 1;
 		bool plus : 1;
+		bool grouping : 1;
+		bool alt : 1;
 		int width;
 		int precision;
 		int lflag;
+		int columns;
+		int flags;
+		bool overflow;
+		format_registry::Compiled const *compiled;
+		size_t token;
 		Option_ opt;
 	} q;
 
 	void _init()
 	{
 		q.list = {};
+		q.overflow = false;
 	}
 
 	void clear()
 	{
 		free_list(&q.list);
 	}
+	/**
+	 * @brief Move the state of `r` into this formatter and reset `r`.
+	 *
+	 * Blocks that can change owner are adopted as they are; only parts in
+	 * the inline storage of `r` are copied.
+	 */
+	void take(basic_string_formatter &r)
+	{
+		allocator.take(r.allocator);
+		Part *p = r.q.list.head;
+		q = r.q;
+		q.list = {};
+		while (p) {
+			Part *next = p->next;
+			if (r.allocator.is_inline(p)) {
+				p = copy_part(p);
+			} else {
+				p->next = nullptr;
+			}
+			add_part(&q.list, p);
+			p = next;
+		}
+		r.q.list = {};
+		r.reset(0, {});
+	}
 	bool advance(bool complete)
 	{
+		STRFORMAT_PROFILE_SCOPE(Scan);
+		if (q.compiled) {
+			// literal and, when completing, unused spec text is referenced as is
+			while (q.token < q.compiled->count) {
+				format_registry::Token const &t = q.compiled->tokens[q.token];
+				if (t.is_spec && !complete) return true;
+				add_part(&q.list, alloc_ref(q.text.data() + t.offset, (int)t.length));
+				q.token++;
+			}
+			return false;
+		}
 		bool r = false;
 		auto Flush = [&](){
 			if (q.head < q.next) {
-				Part *p = alloc_part(q.head, q.next);
+				Part *p = alloc_ref(q.head, int(q.next - q.head));
 				add_part(&q.list, p);
 				q.head = q.next;
 			}
 		};
-		while (*q.next) {
-			if (*q.next == '%') {
-				if (q.next[1] == '%') {
-					q.next++;
-					Flush();
-					q.next++;
-					q.head = q.next;
-				} else if (complete) {
-					q.next++;
-				} else {
-					r = true;
-					break;
-				}
-			} else {
+		char const *end = q.text.data() + q.text.size();
+		while (q.next < end) {
+			q.next = misc::find_percent(q.next, end);
+			if (q.next == end) break;
+			if (q.next + 1 < end && q.next[1] == '%') {
+				q.next++;
+				Flush();
+				q.next++;
+				q.head = q.next;
+			} else if (complete) {
 				q.next++;
+			} else {
+				r = true;
+				break;
 			}
 		}
 		Flush();
@@ -775,70 +3440,285 @@ private:
 		int pr = q.precision < 0 ? 6 : q.precision;
 		return format_double(value, pr, trim_zeros, q.plus);
 	}
+	/**
+	 * @brief "%a" and "%A": exact hexadecimal float.
+	 *
+	 * Zero padding goes after the "0x" prefix, as in printf.
+	 */
+	Part *format_a(double value)
+	{
+		size_t size = misc::hexfloat_bound(q.precision);
+		char small[40];
+		char *ptr = size <= sizeof(small) ? small : (char *)alloca(size);
+		char *end = misc::write_hexfloat(ptr, value, q.precision, q.upper, q.plus, q.alt);
+		int padlen = q.width - int(end - ptr);
+		if (!q.zero_padding || q.align_left || padlen <= 0 || !std::isfinite(value)) {
+			return alloc_part(ptr, end);
+		}
+		Part *p = new_part(sizeof(Part) + (end - ptr) + padlen);
+		if (!p) return nullptr;
+		int prefix = (ptr[0] == '-' || ptr[0] == '+') ? 3 : 2;
+		memcpy(p->data, ptr, prefix);
+		memset(p->data + prefix, '0', padlen);
+		memcpy(p->data + prefix + padlen, ptr + prefix, (end - ptr) - prefix);
+		p->size = int(end - ptr) + padlen;
+		p->data[p->size] = 0;
+		return p;
+	}
 #endif
 	Part *format_c(char c)
 	{
 		return alloc_part(&c, &c + 1);
 	}
-	Part *format_o32(uint32_t value, int hint)
+	/**
+	 * @brief Final conversion of an argument.
+	 *
+	 * The 32-bit text conversions are widened at run time for "%l".
+	 */
+	enum class Conv : uint8_t {
+		Char,
+		Int32,
+		Uint32,
+		Int64,
+		Uint64,
+		Oct32,
+		Oct64,
+		Hex32,
+		Hex64,
+		Hex64Lower,	// "%X" on lu() has always printed lower case
+		Bin32,
+		Bin64,
+		Double,
+		DoubleTrim,
+		HexFloat,
+		Text,
+		Json,
+		Markup,
+		Base64,
+#ifdef STRFORMAT_INT128
+		Int128,
+		Uint128,
+		Oct128,
+		Hex128,
+		Bin128,
+#endif
+	};
+	/**
+	 * @brief Argument kind; o() and x() keep their own default conversion.
+	 */
+	enum Kind {
+		KindInt32,
+		KindUint32,
+		KindInt64,
+		KindUint64,
+		KindOct32,
+		KindOct64,
+		KindHex32,
+		KindHex64,
+		KindDouble,
+		KindText,
+#ifdef STRFORMAT_INT128
+		KindInt128,
+		KindUint128,
+#endif
+		KindCount,
+	};
+	using Route = std::array<Conv, 27>; // 'a'..'z', then any other letter
+	/**
+	 * @brief Conversion for each letter applied to a kind.
+	 */
+	static constexpr Route make_route(Kind kind)
+	{
+		bool wide = kind == KindInt64 || kind == KindUint64 || kind == KindOct64 || kind == KindHex64 || kind == KindDouble;
+		Conv def = Conv::Text;
+		switch (kind) {
+		case KindInt32:  def = Conv::Int32;  break;
+		case KindUint32: def = Conv::Uint32; break;
+		case KindInt64:  def = Conv::Int64;  break;
+		case KindUint64: def = Conv::Uint64; break;
+		case KindOct32:  def = Conv::Oct32;  break;
+		case KindOct64:  def = Conv::Oct64;  break;
+		case KindHex32:  def = Conv::Hex32;  break;
+		case KindHex64:  def = Conv::Hex64;  break;
+		case KindDouble: def = Conv::Double; break;
+#ifdef STRFORMAT_INT128
+		case KindInt128:  def = Conv::Int128;  break;
+		case KindUint128: def = Conv::Uint128; break;
+#endif
+		default: break;
+		}
+		Route r = {};
+		for (auto &c : r) {
+			c = def;
+		}
+		auto Set = [&](char letter, Conv conv){
+			r[letter - 'a'] = conv;
+		};
+		Set('c', Conv::Char);
+		Set('d', wide ? Conv::Int64 : Conv::Int32);
+		Set('u', wide ? Conv::Uint64 : Conv::Uint32);
+		Set('o', wide ? Conv::Oct64 : Conv::Oct32);
+		Set('x', wide ? Conv::Hex64 : Conv::Hex32);
+		Set('b', wide ? Conv::Bin64 : Conv::Bin32);
+		Set('f', Conv::Double);
+		Set('a', Conv::HexFloat);
+		switch (kind) {
+		case KindUint64:
+			Set('x', Conv::Hex64Lower);
+			break;
+		case KindDouble:
+			Set('s', Conv::DoubleTrim);
+			break;
+		case KindText:
+			Set('s', Conv::Text);
+			Set('j', Conv::Json);
+			Set('m', Conv::Markup);
+			Set('y', Conv::Base64);
+			break;
+#ifdef STRFORMAT_INT128
+		case KindInt128:
+		case KindUint128:
+			Set('d', Conv::Int128);
+			Set('u', Conv::Uint128);
+			Set('o', Conv::Oct128);
+			Set('x', Conv::Hex128);
+			Set('b', Conv::Bin128);
+			break;
+#endif
+		default:
+			break;
+		}
+		return r;
+	}
+	static constexpr std::array<Route, KindCount> routes = {
+		make_route(KindInt32),
+		make_route(KindUint32),
+		make_route(KindInt64),
+		make_route(KindUint64),
+		make_route(KindOct32),
+		make_route(KindOct64),
+		make_route(KindHex32),
+		make_route(KindHex64),
+		make_route(KindDouble),
+		make_route(KindText),
+#ifdef STRFORMAT_INT128
+		make_route(KindInt128),
+		make_route(KindUint128),
+#endif
+	};
+	static Conv route(Kind kind, int hint)
+	{
+		unsigned i = unsigned(hint - 'a');
+		return routes[kind][i < 26 ? i : 26];
+	}
+	/**
+	 * @brief Run the conversion `conv` on a numeric argument.
+	 */
+	template <typename T> Part *convert(T value, Conv conv)
 	{
-		if (hint) {
-			switch (hint) {
-			case 'c': return format_c((char)value);
-			case 'd': return format((int32_t)value, 0);
-			case 'u': return format(value, 0);
-			case 'x': return format_x32(value, 0);
+		switch (conv) {
+		case Conv::Char:       return format_c((char)value);
+		case Conv::Int32:      return format_int32((int32_t)value, q.plus);
+		case Conv::Uint32:     return format_uint32((uint32_t)value);
+		case Conv::Int64:      return format_int64((int64_t)value, q.plus);
+		case Conv::Uint64:     return format_uint64((uint64_t)value);
+		case Conv::Oct32:      return format_oct32((uint32_t)value);
+		case Conv::Oct64:      return format_oct64((uint64_t)value);
+		case Conv::Hex32:      return format_hex32((uint32_t)value, q.upper);
+		case Conv::Hex64:      return format_hex64((uint64_t)value, q.upper);
+		case Conv::Hex64Lower: return format_hex64((uint64_t)value, false);
+		case Conv::Bin32:      return format_bin32((uint32_t)value);
+		case Conv::Bin64:      return format_bin64((uint64_t)value);
+#ifdef STRFORMAT_INT128
+		case Conv::Int128:     return format_int128((int128_t)value, q.plus);
+		case Conv::Uint128:    return format_uint128((uint128_t)value);
+		case Conv::Oct128:     return format_oct128((uint128_t)value);
+		case Conv::Hex128:     return format_hex128((uint128_t)value, q.upper);
+		case Conv::Bin128:     return format_bin128((uint128_t)value);
+#endif
 #ifndef STRFORMAT_NO_FP
-			case 'f': return format((double)value, 0);
+		case Conv::Double:     return format_f((double)value, false);
+		case Conv::DoubleTrim: return format_f((double)value, true);
+		case Conv::HexFloat:   return format_a((double)value);
 #endif
-			}
+		default:               return nullptr;
 		}
-		return format_oct32(value);
 	}
-	Part *format_o64(uint64_t value, int hint)
+	template <Kind K, typename T> Part *format_as(T value, int hint)
 	{
-		if (hint) {
-			switch (hint) {
-			case 'c': return format_c((char)value);
-			case 'd': return format((int64_t)value, 0);
-			case 'u': return format(value, 0);
-			case 'x': return format_x64(value, 0);
-#ifndef STRFORMAT_NO_FP
-			case 'f': return format((double)value, 0);
-#endif
-			}
-		}
-		return format_oct64(value);
+		return convert(value, route(K, hint));
 	}
-	Part *format_x32(uint32_t value, int hint)
+	/**
+	 * @brief Text argument: printed as is, or parsed for a numeric conversion.
+	 */
+	Part *format_text(char const *value, size_t len, int hint, bool borrow = false)
 	{
-		if (hint) {
-			switch (hint) {
-			case 'c': return format_c((char)value);
-			case 'd': return format((int32_t)value, 0);
-			case 'u': return format(value, 0);
-			case 'o': return format_o32(value, 0);
+		if (!value && hint != 's') {
+			return alloc_part("(null)");
+		}
+		Conv conv = route(KindText, hint);
+		if (q.lflag != 0) {
+			switch (conv) {
+			case Conv::Int32:  conv = Conv::Int64;      break;
+			case Conv::Uint32: conv = Conv::Uint64;     break;
+			case Conv::Oct32:  conv = Conv::Oct64;      break;
+			case Conv::Hex32:  conv = Conv::Hex64Lower; break;
+			case Conv::Bin32:  conv = Conv::Bin64;      break;
+			default: break;
+			}
+		}
+		switch (conv) {
+		case Conv::Char:
+			return format_c(num<char>(value, q.opt));
+		case Conv::Int32:
+			return convert(num<int32_t>(value, q.opt), conv);
+		case Conv::Int64:
+			return convert(num<int64_t>(value, q.opt), conv);
+		case Conv::Uint32: case Conv::Oct32: case Conv::Hex32: case Conv::Bin32:
+			return convert(num<uint32_t>(value, q.opt), conv);
+		case Conv::Uint64: case Conv::Oct64: case Conv::Hex64Lower: case Conv::Bin64:
+			return convert(num<uint64_t>(value, q.opt), conv);
 #ifndef STRFORMAT_NO_FP
-			case 'f': return format((double)value, 0);
+		case Conv::Double: case Conv::HexFloat:
+			return convert(num<double>(value, q.opt), conv);
 #endif
-			}
+		case Conv::Json:
+			return format_escaped(value, len, escape::Json, borrow);
+		case Conv::Markup:
+			return format_escaped(value, len, escape::Markup, borrow);
+		case Conv::Base64:
+			return format_base64(value, len);
+		default:
+			return format_s(value, len, borrow);
 		}
-		return format_hex32(value, q.upper);
 	}
-	Part *format_x64(uint64_t value, int hint)
+	/**
+	 * @brief "%j" and "%m": the text escaped while it is copied.
+	 */
+	Part *format_escaped(char const *value, size_t len, escape::Mode mode, bool borrow)
 	{
-		if (hint) {
-			switch (hint) {
-			case 'c': return format_c((char)value);
-			case 'd': return format((int64_t)value, 0);
-			case 'u': return format(value, 0);
-			case 'o': return format_o64(value, 0);
-#ifndef STRFORMAT_NO_FP
-			case 'f': return format((double)value, 0);
-#endif
-			}
+		size_t n = escape::size(value, len, mode);
+		if (n == len) {
+			return borrow ? alloc_ref(value, (int)len) : alloc_part(value, (int)len);
 		}
-		return format_hex64(value, q.upper);
+		Part *p = new_part(sizeof(Part) + n);
+		if (!p) return nullptr;
+		p->size = int(escape::copy(p->data, value, len, mode) - p->data);
+		p->data[p->size] = 0;
+		return p;
+	}
+	/**
+	 * @brief "%y" and "%Y": base64 encoded straight into the part.
+	 *
+	 * "%Y" selects the URL-safe alphabet without padding.
+	 */
+	Part *format_base64(void const *value, size_t len)
+	{
+		Part *p = new_part(sizeof(Part) + base64::size(len, !q.upper));
+		if (!p) return nullptr;
+		p->size = int(base64::encode(p->data, value, len, q.upper, !q.upper) - p->data);
+		p->data[p->size] = 0;
+		return p;
 	}
 	Part *format(char c, int hint)
 	{
@@ -847,386 +3727,497 @@ private:
 #ifndef STRFORMAT_NO_FP
 	Part *format(double value, int hint)
 	{
-		if (hint) {
-			switch (hint) {
-			case 'c': return format_c((char)value);
-			case 'd': return format((int64_t)value, 0);
-			case 'u': return format((uint64_t)value, 0);
-			case 'o': return format_o64((uint64_t)value, 0);
-			case 'x': return format_x64((uint64_t)value, 0);
-			case 's': return format_f(value, true);
-			}
-		}
-		return format_f(value, false);
+		return format_as<KindDouble>(value, hint);
 	}
 #endif
 	Part *format(int32_t value, int hint)
 	{
-		if (hint) {
-			switch (hint) {
-			case 'c': return format_c((char)value);
-			case 'u': return format((uint32_t)value, 0);
-			case 'o': return format_o32((uint32_t)value, 0);
-			case 'x': return format_x32((uint32_t)value, 0);
-#ifndef STRFORMAT_NO_FP
-			case 'f': return format((double)value, 0);
-#endif
-			}
-		}
-		return format_int32(value, q.plus);
+		return format_as<KindInt32>(value, hint);
 	}
 	Part *format(uint32_t value, int hint)
 	{
-		if (hint) {
-			switch (hint) {
-			case 'c': return format_c((char)value);
-			case 'd': return format((int32_t)value, 0);
-			case 'o': return format_o32((uint32_t)value, 0);
-			case 'x': return format_x32((uint32_t)value, 0);
-#ifndef STRFORMAT_NO_FP
-			case 'f': return format((double)value, 0);
-#endif
-			}
-		}
-		return format_uint32(value);
+		return format_as<KindUint32>(value, hint);
 	}
 	Part *format(int64_t value, int hint)
 	{
-		if (hint) {
-			switch (hint) {
-			case 'c': return format_c((char)value);
-			case 'u': return format((uint64_t)value, 0);
-			case 'o': return format_o64((uint64_t)value, 0);
-			case 'x': return format_x64((uint64_t)value, 0);
-#ifndef STRFORMAT_NO_FP
-			case 'f': return format((double)value, 0);
-#endif
-			}
-		}
-		return format_int64(value, q.plus);
+		return format_as<KindInt64>(value, hint);
 	}
 	Part *format(uint64_t value, int hint)
 	{
-		if (hint) {
-			switch (hint) {
-			case 'c': return format_c((char)value);
-			case 'd': return format((int64_t)value, 0);
-			case 'o': return format_oct64(value);
-			case 'x': return format_hex64(value, false);
-#ifndef STRFORMAT_NO_FP
-			case 'f': return format((double)value, 0);
-#endif
-			}
-		}
-		return format_uint64(value);
+		return format_as<KindUint64>(value, hint);
+	}
+#ifdef STRFORMAT_INT128
+	Part *format(int128_t value, int hint)
+	{
+		return format_as<KindInt128>(value, hint);
+	}
+	Part *format(uint128_t value, int hint)
+	{
+		return format_as<KindUint128>(value, hint);
 	}
+#endif
 	Part *format(char const *value, int hint)
 	{
 		if (!value) {
 			return alloc_part("(null)");
 		}
-		if (hint) {
-			switch (hint) {
-			case 'c':
-				return format_c(num<char>(value, q.opt));
-			case 'd':
-				if (q.lflag == 0) {
-					return format(num<int32_t>(value, q.opt), 0);
-				} else {
-					return format(num<int64_t>(value, q.opt), 0);
-				}
-			case 'u': case 'o': case 'x':
-				if (q.lflag == 0) {
-					return format(num<uint32_t>(value, q.opt), hint);
-				} else {
-					return format(num<uint64_t>(value, q.opt), hint);
-				}
-#ifndef STRFORMAT_NO_FP
-			case 'f':
-				return format(num<double>(value, q.opt), hint);
-#endif
-			}
-		}
-		return alloc_part(value, value + strlen(value));
+		return format_text(value, strlen(value), hint);
 	}
 	Part *format(std::string_view const &value, int hint)
 	{
-		if (hint == 's') {
-			return alloc_part(value);
-		}
-		return format(value.data(), hint);
+		return format_text(value.data(), value.size(), hint);
 	}
 	Part *format(std::vector<char> const &value, int hint)
 	{
-		std::string_view sv(value.data(), value.size());
+		return format_text(value.data(), value.size(), hint);
+	}
+	Part *format(borrowed const &value, int hint)
+	{
+		return format_text(value.text.data(), value.text.size(), hint, true);
+	}
+	/**
+	 * @brief Byte buffer: hex digits, optionally grouped, a hex dump or base64.
+	 */
+	Part *format(byte_span const &value, int hint)
+	{
 		if (hint == 's') {
-			return alloc_part(sv);
+			return alloc_part((char const *)value.data, (int)value.size);
+		}
+		if (hint == 'y') {
+			return format_base64(value.data, value.size);
+		}
+		size_t n = q.alt ? misc::hexdump_bound(value.size) : 3 * value.size;
+		Part *p = new_part(sizeof(Part) + n);
+		if (!p) return nullptr;
+		char *end;
+		if (q.alt) {
+			end = misc::write_hexdump(p->data, value.data, value.size, q.upper);
+		} else {
+			size_t group = q.precision > 0 ? (size_t)q.precision : 0;
+			end = misc::write_hex_bytes(p->data, value.data, value.size, q.upper, group, value.separator);
+		}
+		p->size = int(end - p->data);
+		p->data[p->size] = 0;
+		return p;
+	}
+	Part *format(decimal const &value, int hint)
+	{
+		(void)hint;
+		int precision = q.precision < 0 ? value.scale : q.precision;
+		size_t size = misc::decimal_bound(precision);
+		char small[40];
+		char *ptr = size <= sizeof(small) ? small : (char *)alloca(size);
+		char *end = misc::write_decimal(ptr, value.value, value.scale, precision, q.plus);
+		if (q.opt.loc && !q.opt.loc->is_c()) {
+			return localize(ptr, end);
+		}
+		return alloc_part(ptr, end);
+	}
+	Part *format(timestamp const &value, int hint)
+	{
+		if (hint != 't') {
+			return format_as<KindInt64>(value.ns, hint);
+		}
+		char tmp[misc::timestamp_bound()];
+		int precision = std::min(q.precision, 9);
+		char *end = misc::write_timestamp(tmp, value.ns, value.offset_minutes, precision, q.upper);
+		return alloc_part(tmp, end);
+	}
+	Part *format_s(char const *value, size_t len, bool borrow = false)
+	{
+		auto Part_ = [&](int size){
+			return borrow ? alloc_ref(value, size) : alloc_part(value, size);
+		};
+		if (!(q.flags & Utf8)) {
+			return Part_((int)len);
+		}
+		size_t n = utf8::ascii_prefix(value, len);
+		if (n == len) {
+			if (q.precision >= 0 && len > (size_t)q.precision) {
+				len = q.precision;
+			}
+			q.columns = (int)len;
+			return Part_((int)len);
+		}
+		utf8::Measure m = utf8::measure(value, len, q.precision, q.flags & EastAsianWidth);
+		q.columns = m.columns;
+		if (m.invalid == 0 || !(q.flags & ReplaceInvalid)) {
+			return Part_((int)m.bytes);
 		}
-		return format(sv, hint);
+		int size = (int)m.bytes + 2 * m.invalid; // upper bound: each replacement adds at most 2 bytes
+		Part *p = new_part(sizeof(Part) + size);
+		if (!p) return nullptr;
+		p->size = int(utf8::copy_replacing_invalid(p->data, value, m.bytes) - p->data);
+		p->data[p->size] = 0;
+		return p;
 	}
 	Part *format_p(void *val)
 	{
 		return format_pointer(val);
 	}
-	void reset_format_params()
+	void apply_spec(format_spec const &spec, int width, int precision)
+	{
+		q.upper = spec.upper;
+		q.zero_padding = spec.zero_padding;
+		q.align_left = spec.align_left;
+		q.plus = spec.plus;
+		q.grouping = spec.grouping;
+		q.alt = spec.alt;
+		q.width = spec.width < 0 ? width : spec.width;
+		q.precision = spec.precision < 0 ? precision : spec.precision;
+		q.lflag = spec.lflag;
+	}
+	int next_spec(int width, int precision)
 	{
-		q.upper = false;
-		q.zero_padding = false;
-		q.align_left = false;
-		q.plus = false;
-		q.width = -1;
-		q.precision = -1;
-		q.lflag = 0;
+		STRFORMAT_PROFILE_SCOPE(Parse);
+		if (q.compiled) {
+			format_spec const &spec = q.compiled->tokens[q.token++].spec;
+			apply_spec(spec, width, precision);
+			return spec.conv;
+		}
+		format_spec spec;
+		q.next = format_spec::parse(q.next, q.text.data() + q.text.size(), &spec);
+		q.head = q.next;
+		apply_spec(spec, width, precision);
+		return spec.conv;
 	}
-	void format(std::function<Part *(int)> const &callback, int width, int precision)
+	template <typename F> void format(F const &callback, int width, int precision)
 	{
 		if (advance(false)) {
-			if (*q.next == '%') {
-				q.next++;
-			}
-
-			reset_format_params();
-
-			while (1) {
-				int c = (unsigned char)*q.next;
-				if (c == '0') {
-					q.zero_padding = true;
-				} else if (c == '+') {
-					q.plus = true;
-				} else if (c == '-') {
-					q.align_left = true;
-				} else {
-					break;
-				}
-				q.next++;
-			}
-
-			auto GetNumber = [&](int alternate_value){
-				int value = -1;
-				if (*q.next == '*') {
-					q.next++;
-				} else {
-					while (1) {
-						int c = (unsigned char)*q.next;
-						if (!isdigit(c)) break;
-						if (value < 0) {
-							value = 0;
-						} else {
-							value *= 10;
-						}
-						value += c - '0';
-						q.next++;
-					}
-				}
-				if (value < 0) {
-					value = alternate_value;
-				}
-				return value;
-			};
-
-			q.width = GetNumber(width);
-
-			if (*q.next == '.') {
-				q.next++;
-			}
-
-			q.precision = GetNumber(precision);
-
-			while (*q.next == 'l') {
-				q.lflag++;
-				q.next++;
-			}
-
 			Part *p = nullptr;
-
-			int c = (unsigned char)*q.next;
-			if (isupper(c)) {
-				q.upper = true;
-				c = tolower(c);
-			}
+			int c = next_spec(width, precision);
 			if (isalpha(c)) {
+				STRFORMAT_PROFILE_SCOPE(Convert);
+				q.columns = -1;
 				p = callback(c);
-				q.next++;
+				if (p && q.grouping && (c == 'd' || c == 'u') && q.opt.loc && !q.opt.loc->is_c()) {
+					p = localize(p->ptr, p->ptr + p->size);
+				}
 			}
 			if (p) {
-				int padlen = q.width - p->size;
-				if (padlen > 0 && !q.align_left) {
-					if (q.zero_padding) {
-						char c = p->data[0];
-						add_chars(&q.list, '0', padlen);
+				STRFORMAT_PROFILE_SCOPE(Pad);
+				int padlen = q.width - (q.columns < 0 ? p->size : q.columns);
+				if (padlen > 0) {
+					p->fill_len = padlen;
+					if (q.align_left) {
+						p->fill_after = true;
+					} else if (q.zero_padding) {
+						p->fill = '0';
+						char c = p->size > 0 ? p->ptr[0] : 0;
 						if (c == '+' || c == '-') {
-							q.list.last->data[0] = c;
-							p->data[0] = '0';
+							p->sign = c;
+							p->ptr++;
+							p->size--;
 						}
-					} else {
-						add_chars(&q.list, ' ', padlen);
 					}
 				}
 
 				add_part(&q.list, p);
-
-				if (padlen > 0 && q.align_left) {
-					add_chars(&q.list, ' ', padlen);
-				}
 			}
-
-			q.head = q.next;
-		}
-	}
-	int length()
-	{
-		advance(true);
-		int len = 0;
-		for (Part *p = q.list.head; p; p = p->next) {
-			len += p->size;
 		}
-		return len;
 	}
 #ifndef STRFORMAT_NO_LOCALE
 	void use_locale(bool use)
 	{
-		if (use) {
-			q.opt.lc = localeconv();
-		} else {
-			q.opt.lc = nullptr;
-		}
+		q.opt.loc = use ? &locale_snapshot::global() : nullptr;
 	}
 #endif
 	void set_flags(int flags)
 	{
+		q.flags = flags;
 #ifndef STRFORMAT_NO_LOCALE
 		use_locale(flags & Locale);
 #endif
 	}
 public:
-	string_formatter(string_formatter const &) = delete;
-	void operator = (string_formatter const &) = delete;
+	basic_string_formatter(basic_string_formatter const &) = delete;
+	void operator = (basic_string_formatter const &) = delete;
 
-	string_formatter(string_formatter &&r)
+	basic_string_formatter(basic_string_formatter &&r)
 	{
-		q = r.q;
-		r._init();
+		_init();
+		take(r);
 	}
-	void operator = (string_formatter &&r)
+	void operator = (basic_string_formatter &&r)
 	{
-		clear();
-		q = r.q;
-		r._init();
+		if (this != &r) {
+			clear();
+			allocator.rewind();
+			take(r);
+		}
+	}
+
+	basic_string_formatter(int flags = 0, std::string_view text = {})
+	{
+		reset(flags, text);
 	}
 
-	string_formatter(int flags = 0, std::string_view text = {})
+	/**
+	 * @brief Construct with a configured allocator instance.
+	 */
+	explicit basic_string_formatter(Allocator &&alloc, int flags = 0, std::string_view text = {})
+		: allocator(std::move(alloc))
 	{
 		reset(flags, text);
 	}
 
-	string_formatter(std::string_view text)
+	basic_string_formatter(std::string_view text)
 	{
 		reset(0, text);
 	}
-	~string_formatter()
+	~basic_string_formatter()
 	{
 		clear();
 	}
 
+	/**
+	 * @brief Heap memory held by the formatter's allocator, in bytes.
+	 */
+	size_t memory_usage() const
+	{
+		return allocator.reserved();
+	}
+
+	/**
+	 * @brief True if the allocator ran out of memory and output was truncated.
+	 */
+	bool overflow() const
+	{
+		return q.overflow;
+	}
+
 	char decimal_point() const
 	{
-#ifndef STRFORMAT_NO_LOCALE
-		if (q.opt.lc && q.opt.lc->decimal_point) {
-			return *q.opt.lc->decimal_point;
+		if (q.opt.loc) {
+			return q.opt.loc->decimal_point()[0];
 		}
-#endif
 		return '.';
 	}
 
-	string_formatter &reset(int flags, std::string_view text)
+	/**
+	 * @brief Use a locale snapshot for %f and the ' flag.
+	 *
+	 * The snapshot must outlive the formatter; pass nullptr to go back to
+	 * locale-independent output.
+	 */
+	basic_string_formatter &set_locale(locale_snapshot const *loc)
+	{
+		q.opt.loc = loc;
+		return *this;
+	}
+
+	/**
+	 * @brief Start over with a new format string.
+	 *
+	 * The allocator is rewound rather than released, so a formatter reused
+	 * in a loop reaches a steady state without further allocations.
+	 */
+	basic_string_formatter &reset(int flags, std::string_view text)
 	{
 		clear();
+		allocator.rewind();
+		q.overflow = false;
 		q.text = text.empty() ? std::string_view("") : text;
 		q.head = q.text.data();
 		q.next = q.head;
+		q.compiled = (flags & Intern) ? format_registry::find(q.text) : nullptr;
+		q.token = 0;
 
-#ifndef STRFORMAT_NO_LOCALE
-		use_locale(flags & Locale);
-#endif
+		set_flags(flags);
 
 		return *this;
 	}
 
-	template <typename T> string_formatter &arg(T const &value, int width = -1, int precision = -1)
+	template <typename T> basic_string_formatter &arg(T const &value, int width = -1, int precision = -1)
 	{
 		format([&](int hint){ return format(value, hint); }, width, precision);
 		return *this;
 	}
 #ifndef STRFORMAT_NO_FP
-	string_formatter &f(double value, int width = -1, int precision = -1)
+	basic_string_formatter &f(double value, int width = -1, int precision = -1)
 	{
 		return arg(value, width, precision);
 	}
 #endif
-	string_formatter &c(char value, int width = -1, int precision = -1)
+	basic_string_formatter &f(decimal const &value, int width = -1, int precision = -1)
+	{
+		return arg(value, width, precision);
+	}
+	basic_string_formatter &c(char value, int width = -1, int precision = -1)
+	{
+		return arg(value, width, precision);
+	}
+	basic_string_formatter &d(int32_t value, int width = -1, int precision = -1)
+	{
+		return arg(value, width, precision);
+	}
+	basic_string_formatter &ld(int64_t value, int width = -1, int precision = -1)
 	{
 		return arg(value, width, precision);
 	}
-	string_formatter &d(int32_t value, int width = -1, int precision = -1)
+	basic_string_formatter &u(uint32_t value, int width = -1, int precision = -1)
 	{
 		return arg(value, width, precision);
 	}
-	string_formatter &ld(int64_t value, int width = -1, int precision = -1)
+	basic_string_formatter &lu(uint64_t value, int width = -1, int precision = -1)
 	{
 		return arg(value, width, precision);
 	}
-	string_formatter &u(uint32_t value, int width = -1, int precision = -1)
+#ifdef STRFORMAT_INT128
+	basic_string_formatter &lld(int128_t value, int width = -1, int precision = -1)
 	{
 		return arg(value, width, precision);
 	}
-	string_formatter &lu(uint64_t value, int width = -1, int precision = -1)
+	basic_string_formatter &llu(uint128_t value, int width = -1, int precision = -1)
 	{
 		return arg(value, width, precision);
 	}
-	string_formatter &o(int32_t value, int width = -1, int precision = -1)
+#endif
+	basic_string_formatter &o(int32_t value, int width = -1, int precision = -1)
 	{
-		format([&](int hint){ return format_o32(value, hint); }, width, precision);
+		format([&](int hint){ return format_as<KindOct32>((uint32_t)value, hint); }, width, precision);
 		return *this;
 	}
-	string_formatter &lo(int64_t value, int width = -1, int precision = -1)
+	basic_string_formatter &lo(int64_t value, int width = -1, int precision = -1)
 	{
-		format([&](int hint){ return format_o64(value, hint); }, width, precision);
+		format([&](int hint){ return format_as<KindOct64>((uint64_t)value, hint); }, width, precision);
 		return *this;
 	}
-	string_formatter &x(int32_t value, int width = -1, int precision = -1)
+	basic_string_formatter &x(int32_t value, int width = -1, int precision = -1)
 	{
-		format([&](int hint){ return format_x32(value, hint); }, width, precision);
+		format([&](int hint){ return format_as<KindHex32>((uint32_t)value, hint); }, width, precision);
 		return *this;
 	}
-	string_formatter &lx(int64_t value, int width = -1, int precision = -1)
+	basic_string_formatter &lx(int64_t value, int width = -1, int precision = -1)
 	{
-		format([&](int hint){ return format_x64(value, hint); }, width, precision);
+		format([&](int hint){ return format_as<KindHex64>((uint64_t)value, hint); }, width, precision);
 		return *this;
 	}
-	string_formatter &s(char const *value, int width = -1, int precision = -1)
+	basic_string_formatter &s(char const *value, int width = -1, int precision = -1)
+	{
+		return arg(value, width, precision);
+	}
+	basic_string_formatter &s(std::string_view const &value, int width = -1, int precision = -1)
 	{
 		return arg(value, width, precision);
 	}
-	string_formatter &s(std::string_view const &value, int width = -1, int precision = -1)
+	basic_string_formatter &s_ref(std::string_view const &value, int width = -1, int precision = -1)
+	{
+		return arg(borrowed{value}, width, precision);
+	}
+	/**
+	 * @brief `size` bytes at `data`, for "%h"/"%H" (see byte_span).
+	 */
+	basic_string_formatter &h(void const *data, size_t size, int width = -1, int precision = -1)
+	{
+		return arg(byte_span(data, size), width, precision);
+	}
+	basic_string_formatter &t(timestamp const &value, int width = -1, int precision = -1)
 	{
 		return arg(value, width, precision);
 	}
-	string_formatter &p(void *value, int width = -1, int precision = -1)
+	basic_string_formatter &p(void *value, int width = -1, int precision = -1)
 	{
 		format([&](int hint){ (void)hint; return format_p(value); }, width, precision);
 		return *this;
 	}
 
-	template <typename T> string_formatter &operator () (T const &value, int width = -1, int precision = -1)
+	/**
+	 * @brief One argument made of `count` integers joined by `delimiter`.
+	 *
+	 * "%x"/"%X" prints the elements in hex, any other conversion in
+	 * decimal.  Width pads the joined text; '+' marks each positive element.
+	 */
+	template <typename T> basic_string_formatter &array(T const *values, size_t count, std::string_view delimiter = ",", int width = -1)
+	{
+		format([&](int hint){
+			Part *p = new_part(sizeof(Part) + misc::array_bound(count, delimiter.size()));
+			if (!p) return p;
+			char *end = misc::write_array(p->data, values, count, delimiter, hint == 'x', q.upper, q.plus);
+			p->size = int(end - p->data);
+			p->data[p->size] = 0;
+			return p;
+		}, width, -1);
+		return *this;
+	}
+#ifndef STRFORMAT_NO_FP
+	/**
+	 * @brief One argument made of `count` doubles printed as "%.Nf".
+	 *
+	 * The precision of the specification applies to every element (6 if
+	 * omitted).  Under a non-C locale each element is localized on its own.
+	 */
+	basic_string_formatter &array(double const *values, size_t count, std::string_view delimiter = ",", int width = -1, int precision = -1)
+	{
+		format([&](int hint){
+			(void)hint;
+			int pr = q.precision < 0 ? 6 : q.precision;
+			if (q.opt.loc && !q.opt.loc->is_c()) {
+				std::string s;
+				for (size_t i = 0; i < count; i++) {
+					if (i > 0) s.append(delimiter);
+					Part *e = format_double(values[i], pr, false, q.plus);
+					if (!e) return e;
+					s.append(e->ptr, e->size);
+					free_part(&e);
+				}
+				return alloc_part(s.data(), (int)s.size());
+			}
+			Part *p = new_part(sizeof(Part) + misc::fixed_array_bound(values, count, pr, delimiter.size()));
+			if (!p) return p;
+			char *end = misc::write_fixed_array(p->data, values, count, pr, delimiter, q.plus);
+			p->size = int(end - p->data);
+			p->data[p->size] = 0;
+			return p;
+		}, width, precision);
+		return *this;
+	}
+#endif
+	template <typename T> basic_string_formatter &array(std::vector<T> const &values, std::string_view delimiter = ",", int width = -1)
+	{
+		return array(values.data(), values.size(), delimiter, width);
+	}
+
+	template <typename T> basic_string_formatter &operator () (T const &value, int width = -1, int precision = -1)
 	{
 		return arg(value, width, precision);
 	}
-	void render(std::function<void (char const *ptr, int len)> const &to)
+	int length()
 	{
 		advance(true);
+		int len = 0;
 		for (Part *p = q.list.head; p; p = p->next) {
-			to(p->data, p->size);
+			len += part_length(p);
 		}
+		return len;
+	}
+	void render(std::function<void (char const *ptr, int len)> const &to)
+	{
+		render_parts(to, [&](char c, int n){
+			char tmp[64];
+			memset(tmp, c, std::min(n, (int)sizeof(tmp)));
+			while (n > 0) {
+				int m = std::min(n, (int)sizeof(tmp));
+				to(tmp, m);
+				n -= m;
+			}
+		});
+	}
+	/**
+	 * @brief Write the result into `dst`, which must hold length() bytes.
+	 *
+	 * @return Pointer past the last byte written (no NUL is appended).
+	 */
+	char *render_to(char *dst)
+	{
+		render_parts([&](char const *ptr, int len){
+			memcpy(dst, ptr, len);
+			dst += len;
+		}, [&](char c, int n){
+			memset(dst, c, n);
+			dst += n;
+		});
+		return dst;
 	}
 	void write_to(FILE *fp)
 	{
@@ -1240,6 +4231,45 @@ public:
 			::write(fd, ptr, len);
 		});
 	}
+	/**
+	 * @brief Async-signal-safe output.
+	 *
+	 * Uses neither stdio nor the heap: the result is staged in a stack
+	 * buffer and written with write(2), retrying on EINTR and short writes.
+	 *
+	 * @return false if a write failed.
+	 */
+	bool write_raw(int fd)
+	{
+		char buf[256];
+		int n = 0;
+		bool ok = true;
+		auto Flush = [&](){
+			ok = misc::write_all(fd, buf, n) && ok;
+			n = 0;
+		};
+		auto Put = [&](char const *ptr, char c, int len){
+			while (len > 0) {
+				int m = std::min(len, (int)sizeof(buf) - n);
+				if (ptr) {
+					memcpy(buf + n, ptr, m);
+					ptr += m;
+				} else {
+					memset(buf + n, c, m);
+				}
+				n += m;
+				len -= m;
+				if (n == (int)sizeof(buf)) Flush();
+			}
+		};
+		render_parts([&](char const *ptr, int len){
+			Put(ptr, 0, len);
+		}, [&](char c, int len){
+			Put(nullptr, c, len);
+		});
+		Flush();
+		return ok;
+	}
 	void put()
 	{
 		write_to(stdout);
@@ -1251,16 +4281,33 @@ public:
 	void append_to(std::vector<char> *vec)
 	{
 		vec->reserve(vec->size() + length());
-		render([&](char const *ptr, int len){
+		render_parts([&](char const *ptr, int len){
 			vec->insert(vec->end(), ptr, ptr + len);
+		}, [&](char c, int n){
+			vec->insert(vec->end(), n, c);
 		});
 	}
 	void append_to(std::string *str)
 	{
 		str->reserve(str->size() + length());
-		render([&](char const *ptr, int len){
+		render_parts([&](char const *ptr, int len){
 			str->append(ptr, len);
+		}, [&](char c, int n){
+			str->append(n, c);
+		});
+	}
+	/**
+	 * @brief Render into an inline, fixed-capacity string without allocating.
+	 */
+	template <size_t N = inline_capacity<Allocator>::value> fixed_string<N> fixed_str()
+	{
+		fixed_string<N> result;
+		render_parts([&](char const *ptr, int len){
+			result.append(ptr, len);
+		}, [&](char c, int len){
+			result.append(len, c);
 		});
+		return result;
 	}
 	std::vector<char> vec()
 	{
@@ -1268,13 +4315,38 @@ public:
 		append_to(&ret);
 		return ret;
 	}
+	/**
+	 * @brief Render into memory obtained from `mr`.
+	 *
+	 * Intended for a std::pmr::monotonic_buffer_resource that is released
+	 * as a whole.  The view is NUL-terminated and stays valid until the
+	 * resource releases its memory.
+	 */
+	std::string_view str(std::pmr::memory_resource *mr)
+	{
+		size_t len = length();
+		char *ptr = (char *)mr->allocate(len + 1, 1);
+		*render_to(ptr) = 0;
+		return std::string_view(ptr, len);
+	}
+	/**
+	 * @brief Render into a bump arena.
+	 *
+	 * @return A NUL-terminated view into the arena, or an empty view with a
+	 *         null data pointer if the arena is exhausted.
+	 */
+	std::string_view str(bump_arena *arena)
+	{
+		size_t len = length();
+		char *ptr = arena->allocate(len + 1);
+		if (!ptr) return {};
+		*render_to(ptr) = 0;
+		return std::string_view(ptr, len);
+	}
 	std::string str()
 	{
 		std::string result;
-		result.reserve(length());
-		render([&](char const *ptr, int len){
-			result.append(ptr, len);
-		});
+		append_to(&result);
 		return result;
 	}
 	operator std::string ()
@@ -1283,6 +4355,23 @@ public:
 	}
 };
 
+using string_formatter = basic_string_formatter<QuickAlloc>;
+
+/**
+ * @brief Formatter that never touches the heap.
+ *
+ * All parts live in an inline buffer of N bytes; when it is exhausted the
+ * output is truncated and overflow() returns true.  Together with
+ * write_raw() and fixed_str() this is usable from signal handlers and
+ * real-time threads, as long as the Locale flag is not used.
+ */
+template <size_t N> using fixed_formatter = basic_string_formatter<FixedAlloc<N>>;
+
+/**
+ * @brief Formatter that takes its memory from a std::pmr::memory_resource.
+ */
+using pmr_string_formatter = basic_string_formatter<PmrAlloc>;
+
 } // namespace strformat_ns
 
 #endif // STRFORMAT_H
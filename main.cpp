@@ -1,5 +1,6 @@
 
 #include "fmt.h"
+#include "csv_writer.h"
 #include <chrono>
 
 #ifdef _WIN32
@@ -22,6 +23,22 @@ public:
 };
 
 void test();
+void test_reuse();
+void test_move();
+void test_dispatch();
+void test_fixed();
+void test_array();
+void test_csv();
+void test_hex();
+void test_base64();
+void test_timestamp();
+void test_decimal();
+#ifdef STRFORMAT_INT128
+void test_int128();
+#endif
+#ifndef STRFORMAT_NO_FP
+void test_hexfloat();
+#endif
 
 int passed = 0;
 int failed = 0;
@@ -65,6 +82,338 @@ void benchmark()
 	fprintf(stderr, "%lldms\n", (unsigned long long)t.elapsed());
 }
 
+template <typename Formatter, typename Make> void benchmark_allocator(char const *name, Make const &make)
+{
+	ElapsedTimer t;
+	t.start();
+	size_t n = 0;
+	for (int i = 0; i < 300000; i++) {
+		Formatter f = make();
+#ifndef STRFORMAT_NO_FP
+		f.s("Hello, world").d(i).f(123.456).s("fuga");
+#else
+		f.s("Hello, world").d(i).d(123456).s("fuga");
+#endif
+		n += f.length();
+	}
+	fprintf(stderr, "%-12s %lldms (%llu)\n", name, (unsigned long long)t.elapsed(), (unsigned long long)n);
+}
+
+void benchmark_allocators()
+{
+	using namespace strformat_ns;
+	char const *text = "s:%s d:%d f:%f s:%-20s\n";
+	benchmark_allocator<basic_string_formatter<StdAlloc>>("StdAlloc", [&](){ return basic_string_formatter<StdAlloc>(text); });
+	benchmark_allocator<basic_string_formatter<QuickAlloc>>("QuickAlloc", [&](){ return basic_string_formatter<QuickAlloc>(text); });
+	benchmark_allocator<basic_string_formatter<FixedAlloc<512>>>("FixedAlloc", [&](){ return basic_string_formatter<FixedAlloc<512>>(text); });
+	char buf[4096];
+	std::pmr::monotonic_buffer_resource mr(buf, sizeof(buf));
+	benchmark_allocator<pmr_string_formatter>("PmrAlloc", [&](){
+		mr.release();
+		return pmr_string_formatter(PmrAlloc(&mr), 0, text);
+	});
+}
+
+void benchmark_scan()
+{
+	for (size_t n = 16; n <= 4096; n *= 4) {
+		std::string text = std::string(n / 2, 'L') + "%d" + std::string(n / 2, 'L') + "%%";
+		int count = int(256 * 1024 * 1024 / n);
+		ElapsedTimer t;
+		t.start();
+		size_t total = 0;
+		for (int i = 0; i < count; i++) {
+			strformat_ns::fixed_formatter<64> f(text);
+			total += f.d(i).length();
+		}
+		unsigned long ms = t.elapsed();
+		fprintf(stderr, "scan %4llu B  %lldms (%llu)\n", (unsigned long long)n, (unsigned long long)ms, (unsigned long long)total);
+	}
+}
+
+template <typename T> void benchmark_array(char const *name, char const *text)
+{
+	std::vector<T> values(1000000);
+	uint64_t seed = 88172645463325252;
+	for (T &v : values) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		v = T(seed >> (seed % 64));
+	}
+	std::vector<char> buf(strformat_ns::misc::array_bound(values.size(), 1));
+	ElapsedTimer t;
+	t.start();
+	size_t bytes = 0;
+	for (int i = 0; i < 20; i++) {
+		char *end = strformat_ns::misc::write_array(buf.data(), values.data(), values.size(), ",");
+		bytes += end - buf.data();
+	}
+	unsigned long ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "array %-8s %4lldms %6.0f MB/s\n", name, (unsigned long long)ms, bytes / 1000.0 / ms);
+
+	t.start();
+	bytes = 0;
+	for (int i = 0; i < 20; i++) {
+		std::string out;
+		for (T v : values) {
+			fmt f(text);
+			f(v).append_to(&out);
+		}
+		bytes += out.size();
+	}
+	ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "  per-element %4lldms %6.0f MB/s\n", (unsigned long long)ms, bytes / 1000.0 / ms);
+}
+
+#ifndef STRFORMAT_NO_FP
+void benchmark_doubles()
+{
+	std::vector<double> values(1000000);
+	uint64_t seed = 88172645463325252;
+	for (double &v : values) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		v = double(int64_t(seed % 2000000000) - 1000000000) / 8192;
+	}
+	ElapsedTimer t;
+	t.start();
+	size_t bytes = 0;
+	for (int i = 0; i < 5; i++) {
+		std::string out = fmt("%.6f").array(values).str();
+		bytes += out.size();
+	}
+	unsigned long ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "array double %4lldms %6.0f MB/s\n", (unsigned long long)ms, bytes / 1000.0 / ms);
+
+	t.start();
+	bytes = 0;
+	for (int i = 0; i < 5; i++) {
+		std::string out;
+		for (double v : values) {
+			fmt f("%.6f,");
+			f.f(v).append_to(&out);
+		}
+		bytes += out.size();
+	}
+	ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "  per-element %4lldms %6.0f MB/s\n", (unsigned long long)ms, bytes / 1000.0 / ms);
+}
+#endif
+
+void benchmark_csv()
+{
+	static char const *names[] = { "alice", "bob", "carol, jr.", "dave \"the\" diver", "eve" };
+	int const rows = 1000000;
+
+	FILE *fp = tmpfile();
+	if (!fp) return;
+	ElapsedTimer t;
+	t.start();
+	{
+		strformat_ns::csv_writer csv(fp);
+#ifndef STRFORMAT_NO_FP
+		csv.columns({ "%d", "%s", "%.3f", "%x" });
+		for (int i = 0; i < rows; i++) {
+			csv.row(i, names[i % 5], i * 0.001, i);
+		}
+#else
+		csv.columns({ "%d", "%s", "%d", "%x" });
+		for (int i = 0; i < rows; i++) {
+			csv.row(i, names[i % 5], i % 1000, i);
+		}
+#endif
+	}
+	unsigned long ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "csv_writer   %4lldms %6.2f Mrows/s\n", (unsigned long long)ms, rows / 1000.0 / ms);
+
+	rewind(fp);
+	t.start();
+	{
+		std::string out;
+		for (int i = 0; i < rows; i++) {
+#ifndef STRFORMAT_NO_FP
+			fmt("%d,%s,%.3f,%x\n").d(i).s(names[i % 5]).f(i * 0.001).x(i).append_to(&out);
+#else
+			fmt("%d,%s,%d,%x\n").d(i).s(names[i % 5]).d(i % 1000).x(i).append_to(&out);
+#endif
+			if (out.size() >= (1 << 20)) {
+				fwrite(out.data(), 1, out.size(), fp);
+				out.clear();
+			}
+		}
+		fwrite(out.data(), 1, out.size(), fp);
+	}
+	ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "  append_to  %4lldms %6.2f Mrows/s (unquoted)\n", (unsigned long long)ms, rows / 1000.0 / ms);
+	fclose(fp);
+}
+
+void benchmark_hex()
+{
+	std::vector<unsigned char> buf(4096);
+	for (size_t i = 0; i < buf.size(); i++) {
+		buf[i] = (unsigned char)(i * 131 + 7);
+	}
+	int const loops = 20000;
+	size_t bytes = 0;
+	ElapsedTimer t;
+	t.start();
+	for (int i = 0; i < loops; i++) {
+		bytes += fmt("%h").h(buf.data(), buf.size()).str().size();
+	}
+	unsigned long ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "hex 4KiB     %4lldms %6.2f us each\n", (unsigned long long)ms, ms * 1000.0 / loops);
+
+	t.start();
+	for (int i = 0; i < loops; i++) {
+		bytes += fmt("%#h").h(buf.data(), buf.size()).str().size();
+	}
+	ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "  hexdump    %4lldms %6.2f us each\n", (unsigned long long)ms, ms * 1000.0 / loops);
+
+	t.start();
+	for (int i = 0; i < loops; i++) {
+		std::string s(buf.size() * 2, 0);
+		for (size_t j = 0; j < buf.size(); j++) {
+			snprintf(&s[j * 2], 3, "%02x", buf[j]);
+		}
+		bytes += s.size();
+	}
+	ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "  snprintf   %4lldms %6.2f us each (%zu)\n", (unsigned long long)ms, ms * 1000.0 / loops, bytes);
+}
+
+void benchmark_base64()
+{
+	std::vector<unsigned char> buf(4096);
+	for (size_t i = 0; i < buf.size(); i++) {
+		buf[i] = (unsigned char)(i * 131 + 7);
+	}
+	int const loops = 20000;
+	size_t bytes = 0;
+	ElapsedTimer t;
+	t.start();
+	for (int i = 0; i < loops; i++) {
+		bytes += fmt("%y").h(buf.data(), buf.size()).str().size();
+	}
+	unsigned long ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "base64 4KiB  %4lldms %6.0f MB/s in (%zu)\n", (unsigned long long)ms, buf.size() * (double)loops / 1000.0 / ms, bytes);
+}
+
+void benchmark_timestamp()
+{
+	int const loops = 2000000;
+	int64_t start = 1700000000000000000;
+	size_t bytes = 0;
+	ElapsedTimer t;
+	t.start();
+	for (int i = 0; i < loops; i++) {
+		bytes += fmt("%.6T ").t(start + int64_t(i) * 1000).str().size();
+	}
+	unsigned long ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "timestamp    %4lldms\n", (unsigned long long)ms);
+
+	t.start();
+	for (int i = 0; i < loops; i++) {
+		int64_t ns = start + int64_t(i) * 1000;
+		time_t sec = time_t(ns / 1000000000);
+		struct tm tm;
+		gmtime_r(&sec, &tm);
+		char buf[64];
+		size_t n = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+		snprintf(buf + n, sizeof(buf) - n, ".%06dZ", int(ns % 1000000000 / 1000));
+		bytes += fmt("%s ").s(buf).str().size();
+	}
+	ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "  strftime   %4lldms (%zu)\n", (unsigned long long)ms, bytes);
+}
+
+void benchmark_decimal()
+{
+	int const loops = 2000000;
+	size_t bytes = 0;
+	ElapsedTimer t;
+	t.start();
+	for (int i = 0; i < loops; i++) {
+		bytes += fmt("%.2f").f(strformat_ns::decimal(int64_t(i) * 7919 - 5000000, 4)).str().size();
+	}
+	unsigned long ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "decimal      %4lldms\n", (unsigned long long)ms);
+
+#ifndef STRFORMAT_NO_FP
+	t.start();
+	for (int i = 0; i < loops; i++) {
+		bytes += fmt("%.2f").f((int64_t(i) * 7919 - 5000000) / 1e4).str().size();
+	}
+	ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "  double     %4lldms (%zu)\n", (unsigned long long)ms, bytes);
+#endif
+}
+
+#ifdef STRFORMAT_INT128
+void benchmark_int128()
+{
+	using strformat_ns::uint128_t;
+	int const loops = 2000000;
+	uint128_t base = uint128_t(0x0123456789abcdefull) << 64;
+	size_t bytes = 0;
+	ElapsedTimer t;
+	t.start();
+	for (int i = 0; i < loops; i++) {
+		bytes += fmt("%llu").llu(base * (i + 1) + i).str().size();
+	}
+	unsigned long ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "llu          %4lldms\n", (unsigned long long)ms);
+
+	t.start();
+	for (int i = 0; i < loops; i++) {
+		uint128_t v = base * (i + 1) + i;
+		char tmp[48];
+		char *p = tmp + sizeof(tmp);
+		do {
+			*--p = char('0' + int(v % 10));
+			v /= 10;
+		} while (v != 0);
+		bytes += fmt("%s").s(std::string_view(p, tmp + sizeof(tmp) - p)).str().size();
+	}
+	ms = std::max(t.elapsed(), 1ul);
+	fprintf(stderr, "  per-digit  %4lldms (%zu)\n", (unsigned long long)ms, bytes);
+}
+#endif
+
+#ifndef STRFORMAT_NO_FP
+void benchmark_hexfloat()
+{
+	std::vector<double> values(1000000);
+	uint64_t seed = 88172645463325252;
+	for (double &v : values) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		v = double(int64_t(seed % 2000000000) - 1000000000) / 8191;
+	}
+	for (char const *spec : { "%a", "%.17f" }) {
+		ElapsedTimer t;
+		t.start();
+		std::vector<std::string> texts;
+		texts.reserve(values.size());
+		for (double v : values) {
+			texts.push_back(fmt(spec).f(v).str());
+		}
+		unsigned long write_ms = std::max(t.elapsed(), 1ul);
+		t.start();
+		size_t lossy = 0;
+		for (size_t i = 0; i < values.size(); i++) {
+			lossy += strformat_ns::misc::my_strtod(texts[i].c_str(), nullptr) != values[i];
+		}
+		unsigned long read_ms = std::max(t.elapsed(), 1ul);
+		fprintf(stderr, "%-12s write %4lldms read %4lldms, %zu of %zu changed\n", spec, (unsigned long long)write_ms, (unsigned long long)read_ms, lossy, values.size());
+	}
+}
+#endif
+
 int main()
 {
 	if (0) {
@@ -75,10 +424,49 @@ int main()
 #if 1
 	report_error = true;
 	test();
+	test_reuse();
+	test_move();
+	test_dispatch();
+#ifndef STRFORMAT_NO_FP
+	test_fixed();
+#endif
+	test_array();
+	test_csv();
+	test_hex();
+	test_base64();
+	test_timestamp();
+	test_decimal();
+#ifdef STRFORMAT_INT128
+	test_int128();
+#endif
+#ifndef STRFORMAT_NO_FP
+	test_hexfloat();
+#endif
 	print_result();
 
 	benchmark();
+	benchmark_allocators();
+	benchmark_scan();
+	benchmark_array<int32_t>("int32", "%d,");
+	benchmark_array<uint64_t>("uint64", "%lu,");
+#ifndef STRFORMAT_NO_FP
+	benchmark_doubles();
+#endif
+	benchmark_csv();
+	benchmark_hex();
+	benchmark_base64();
+	benchmark_timestamp();
+	benchmark_decimal();
+#ifdef STRFORMAT_INT128
+	benchmark_int128();
+#endif
+#ifndef STRFORMAT_NO_FP
+	benchmark_hexfloat();
+#endif
 
+#ifdef STRFORMAT_PROFILE
+	strformat_ns::profiler::dump(stderr);
+#endif
 
 #else
 	std::string s;
@@ -14,4 +14,5 @@ SOURCES += \
     ../test.cpp
 
 HEADERS += \
+    ../include/csv_writer.h \
     ../include/strformat.h
@@ -1,11 +1,72 @@
 
 #include "fmt.h"
+#include "csv_writer.h"
+#include <cfloat>
 #include <cmath>
+#include <thread>
 
 void test_(char const *text, std::string const &result, char const *answer1, char const *answer2, char const *file, int line);
 
 #define TEST1(Q, A1)         test_(#Q, (Q).str(), A1, nullptr, __FILE__, __LINE__)
 #define TEST2(Q, A1, A2)     test_(#Q, (Q).str(), A1, A2     , __FILE__, __LINE__)
+#define TEST_MISMATCHES(M)   (M).report(__FILE__, __LINE__)
+
+/**
+ * @brief xorshift64 generator for the randomized tests.
+ */
+class XorShift64 {
+private:
+	uint64_t seed_;
+public:
+	XorShift64(uint64_t seed)
+		: seed_(seed)
+	{
+	}
+	uint64_t operator()()
+	{
+		seed_ ^= seed_ << 13;
+		seed_ ^= seed_ >> 7;
+		seed_ ^= seed_ << 17;
+		return seed_;
+	}
+};
+
+/**
+ * @brief Collects the failures of a differential test.
+ *
+ * Only the first mismatch is kept; TEST_MISMATCHES() reports it together
+ * with the input that produced it.
+ */
+class Mismatches {
+private:
+	int count_ = 0;
+	std::string input_;
+	std::string result_;
+	std::string expected_;
+public:
+	void fail(std::string const &input, std::string_view result, std::string_view expected)
+	{
+		if (count_++ == 0) {
+			input_ = input;
+			result_ = result;
+			expected_ = expected;
+		}
+	}
+	/**
+	 * @param input Called on the first mismatch only, to describe the input.
+	 */
+	template <typename F> bool check(std::string_view result, std::string_view expected, F input)
+	{
+		if (result == expected) return true;
+		fail(input(), result, expected);
+		return false;
+	}
+	void report(char const *file, int line) const
+	{
+		std::string text = fmt("%d mismatches, first at %s").d(count_).s(input_).str();
+		test_(text.c_str(), result_, expected_.c_str(), nullptr, file, line);
+	}
+};
 
 void test()
 {
@@ -406,7 +467,9 @@ void test()
 	TEST1(fmt("(%f)").s("-0x50")
 		 , "(-80.000000)");
 	TEST1(fmt("(%f)").s("0x50.5")
-		 , "(80.000000)");
+		 , "(80.312500)");
+	TEST1(fmt("(%f)").s("0x1.8p+1")
+		 , "(3.000000)");
 	TEST1(fmt("(%f)").s("0755")
 		 , "(493.000000)");
 	TEST1(fmt("(%+f)").s("0755")
@@ -548,6 +611,389 @@ void test()
 		 , "-123.456");
 #endif
 
+	// locale
+
+	{
+		strformat_ns::locale_snapshot de(",", ".", "\3");
+		strformat_ns::locale_snapshot in(".", ",", "\3\2");
+		strformat_ns::locale_snapshot c;
+		TEST1(fmt("%'d").set_locale(&de).d(1234567)
+			 , "1.234.567");
+		TEST1(fmt("%'d").set_locale(&de).d(-123)
+			 , "-123");
+		TEST1(fmt("%d").set_locale(&de).d(1234567)
+			 , "1234567");
+		TEST1(fmt("%'lu").set_locale(&de).lu(18446744073709551615ULL)
+			 , "18.446.744.073.709.551.615");
+		TEST1(fmt("%'ld").set_locale(&in).ld(-1234567890)
+			 , "-1,23,45,67,890");
+		TEST1(fmt("(%'12d)").set_locale(&in).d(1234567)
+			 , "(   12,34,567)");
+		TEST1(fmt("%'d").set_locale(&c).d(1234567)
+			 , "1234567");
+		TEST1(fmt("%'d").d(1234567)
+			 , "1234567");
+		TEST1(fmt("%'x").set_locale(&de).x(0x1234567)
+			 , "1234567");
+		TEST1(fmt("%'s").set_locale(&de).s("1234.5")
+			 , "1234.5");
+#ifndef STRFORMAT_NO_FP
+		TEST1(fmt("%.2f").set_locale(&de).f(1234567.891)
+			 , "1234567,89");
+		TEST1(fmt("%'.2f").set_locale(&de).f(-1234567.891)
+			 , "-1.234.567,89");
+		TEST1(fmt("%'+.1f").set_locale(&in).f(1234567.891)
+			 , "+12,34,567.9");
+		TEST1(fmt("%'.0f").set_locale(&de).f(999)
+			 , "999");
+		TEST1(fmt("%s").set_locale(&de).f(2.5)
+			 , "2,5");
+		TEST1(fmt("%.2f").set_locale(&c).f(2.5)
+			 , "2.50");
+#endif
+	}
+
+	// padding
+
+	TEST1(fmt("(%-80s)").s("x")
+		 , ("(x" + std::string(79, ' ') + ")").c_str());
+	TEST1(fmt("(%0100d)").d(-1)
+		 , ("(-" + std::string(98, '0') + "1)").c_str());
+	TEST1(fmt("(%+08d|%-8d|%8d)").d(12).d(-12).d(-12)
+		 , "(+0000012|-12     |     -12)");
+	{
+		fmt f("(%-70s|%070d)");
+		f.s("a").d(-5);
+		std::string s;
+		f.render([&](char const *ptr, int len){ s.append(ptr, len); });
+		TEST1(fmt("%s").s(s)
+			 , ("(a" + std::string(69, ' ') + "|-" + std::string(68, '0') + "5)").c_str());
+	}
+
+	// fixed_formatter
+
+	{
+		using ff = strformat_ns::fixed_formatter<512>;
+		TEST1(ff("(%s|%5d|%x)").s("hoge").d(-12).x(255)
+			 , "(hoge|  -12|ff)");
+		auto s = ff("(%s|%05d)").s("fuga").d(-12).fixed_str();
+		TEST1(fmt("%s/%d/%d").s(s).d((int)s.size()).d(s.truncated())
+			 , "(fuga|-0012)/12/0");
+		ff f("%s");
+		f.s(std::string(1000, 'x'));
+		TEST1(fmt("%d/%d").d(f.overflow()).d(f.length())
+			 , "1/0");
+		f.reset(0, "%d%s");
+		f.d(1).s("ok");
+		TEST1(fmt("%d/%s").d(f.overflow()).s(f.fixed_str())
+			 , "0/1ok");
+		auto t = strformat_ns::fixed_formatter<64>("%-100s|").s("a").fixed_str<16>();
+		TEST1(fmt("%s/%d").s(t).d(t.truncated())
+			 , "a               /1");
+	}
+
+	// arena
+
+	{
+		char buf[64];
+		std::pmr::monotonic_buffer_resource mr(buf, sizeof(buf));
+		std::string_view a = fmt("(%s|%5d)").s("hoge").d(42).str(&mr);
+		std::string_view b = fmt("%-10s|").s("fuga").str(&mr);
+		TEST1(fmt("%s%s").s(a).s(b.data())
+			 , "(hoge|   42)fuga      |");
+
+		strformat_ns::bump_arena arena(buf, sizeof(buf));
+		std::string_view c = fmt("%s-%d").s("key").d(1).str(&arena);
+		TEST1(fmt("%s/%d").s(c).d((int)arena.used())
+			 , "key-1/6");
+		std::string_view d = fmt("%100s").s("x").str(&arena);
+		TEST1(fmt("%d/%d").d(d.data() == nullptr).d((int)arena.used())
+			 , "1/6");
+		arena.reset();
+		TEST1(fmt("%s").s(fmt("%d").d(7).str(&arena))
+			 , "7");
+	}
+
+	// allocator policies
+
+	{
+		using namespace strformat_ns;
+		char buf[1024];
+		std::pmr::monotonic_buffer_resource mr(buf, sizeof(buf));
+		TEST1(pmr_string_formatter(PmrAlloc(&mr), 0, "(%s|%-4d|%s)").s("pmr").d(1).s(std::string(300, 'x'))
+			 , ("(pmr|1   |" + std::string(300, 'x') + ")").c_str());
+		TEST1(basic_string_formatter<StdAlloc>("(%s|%04d)").s("std").d(-1)
+			 , "(std|-001)");
+	}
+
+	// interned format strings
+
+	{
+		static char const *texts[] = {
+			"(%s|%5d|%-5x)", "%%%d%%", "%5%%d", "a%", "%-%%d", "%*5d|%d", "%+08.3f|%lu",
+			"%'d %ld %X", "plain", "", "%d%s%c", "%5 %d", "%010s%", "x%%",
+		};
+		for (char const *t : texts) {
+			for (int n = 0; n <= 3; n++) {
+				fmt a(0, t);
+				fmt b(fmt::Intern, t);
+				for (int i = 0; i < n; i++) {
+					a.d(-12 - i);
+					b.d(-12 - i);
+				}
+				std::string expected = a.str();
+				TEST1(b
+					 , expected.c_str());
+			}
+		}
+		static char const text[] = "(%s|%5d)";
+		TEST1(fmt(fmt::Intern, text).s("a").d(1)
+			 , "(a|    1)");
+		uint64_t hits = strformat_ns::format_registry::this_thread_hits();
+		uint64_t total = strformat_ns::format_registry::hits();
+		TEST1(fmt(text).s("b").d(2)
+			 , "(b|    2)");
+		TEST1(fmt("%d").d(strformat_ns::format_registry::this_thread_hits() - hits)
+			 , "0");
+		TEST1(fmt(fmt::Intern, text).s("c").d(3)
+			 , "(c|    3)");
+		TEST1(fmt("%d").d(strformat_ns::format_registry::this_thread_hits() - hits)
+			 , "1");
+		TEST1(fmt("%d").d(strformat_ns::format_registry::hits() - total >= 1)
+			 , "1");
+	}
+
+	// empty views
+
+	TEST1(fmt("(%s|%d|%s)").s(std::string_view()).s(std::string_view())(std::vector<char>())
+		 , "(|(null)|)");
+	TEST1(fmt("(%x|%lu)").s(std::string_view("ff"))(std::vector<char>{'1', '2', '3', 0})
+		 , "(0|123)");
+
+	// array
+
+	{
+		static int32_t const i32[] = { 0, 1, -1, 42, -2147483647 - 1, 2147483647 };
+		static uint64_t const u64[] = { 0, 9, 10, 99999999, 100000000, 9999999999999999, 10000000000000000, 18446744073709551615u };
+		static int64_t const i64[] = { -9223372036854775807 - 1, -1, 0, 1 };
+		TEST1(fmt("[%d]").array(i32, 6)
+			 , "[0,1,-1,42,-2147483648,2147483647]");
+		TEST1(fmt("[%+d]").array(i32, 6, ", ")
+			 , "[0, +1, -1, +42, -2147483648, +2147483647]");
+		TEST1(fmt("[%x|%X]").array(i32, 6, " ").array(i64, 4, " ")
+			 , "[0 1 ffffffff 2a 80000000 7fffffff|8000000000000000 FFFFFFFFFFFFFFFF 0 1]");
+		TEST1(fmt("%lu").array(u64, 8, "")
+			 , "0910999999991000000009999999999999999100000000000000001844674407370955161"
+			   "5");
+		TEST1(fmt("(%-8d|%8d)").array(i64 + 1, 3).array(std::vector<uint32_t>{ 7 }, "")
+			 , "(-1,0,1  |       7)");
+		TEST1(fmt("(%d)").array(i32, 0)
+			 , "()");
+	}
+
+#ifndef STRFORMAT_NO_FP
+	{
+		static double const f64[] = { 0.125, -2.5, 1e20, NAN, -0.0, 3 };
+		TEST1(fmt("[%.2f]").array(f64, 6, " ")
+			 , "[0.12 -2.50 100000000000000000000.00 #NAN -0.00 3.00]");
+		TEST1(fmt("[%+f|%12.1f]").array(f64 + 4, 2).array(std::vector<double>{ 1.25, 2 }, ";")
+			 , "[-0.000000,+3.000000|     1.2;2.0]");
+	}
+#endif
+
+	// j, m
+
+	TEST1(fmt("{\"k\":\"%j\"}").s("a\"b\\c\n\x01\x1f\x7f\xc3\xa9/")
+		 , "{\"k\":\"a\\\"b\\\\c\\n\\u0001\\u001f\x7f\xc3\xa9/\"}");
+	TEST1(fmt("[%j|%8j|%-4j]").s("clean text that is longer than sixteen bytes").s("\t").s_ref(std::string_view("\b\f\r"))
+		 , "[clean text that is longer than sixteen bytes|      \\t|\\b\\f\\r]");
+	TEST1(fmt("%j").s(std::string(40, 'x') + "\"" + std::string(20, 'y') + "\\")
+		 , (std::string(40, 'x') + "\\\"" + std::string(20, 'y') + "\\\\").c_str());
+	TEST1(fmt("<p title=\"%m\">%m</p>").s("\"it's\"").s("a < b && c > d, \xe6\x97\xa5\xe6\x9c\xac")
+		 , "<p title=\"&quot;it&#39;s&quot;\">a &lt; b &amp;&amp; c &gt; d, \xe6\x97\xa5\xe6\x9c\xac</p>");
+	TEST1(fmt("%m|%j|%j").s("no markup here, only text of some length").d(-5).s(std::string("nul\0in", 6))
+		 , "no markup here, only text of some length|-5|nul\\u0000in");
+
+	// h, H
+
+	{
+		static unsigned char const mac[] = { 0x00, 0x1a, 0x2b, 0x3c, 0x4d, 0x5e };
+		std::string seq;
+		for (int i = 0; i < 40; i++) seq += char(i * 7);
+		TEST1(fmt("%h|%H|%.2h|%.4h").h(mac, 6).h(mac, 6).h(mac, 6).h(mac, 6)
+			 , "001a2b3c4d5e|001A2B3C4D5E|001a 2b3c 4d5e|001a2b3c 4d5e");
+		TEST1(fmt("%.1H|%.3h")(strformat_ns::byte_span(mac, 6, ':')).h(mac, 0)
+			 , "00:1A:2B:3C:4D:5E|");
+		TEST1(fmt("[%14h|%-6h|%s]").h(mac, 3).h(mac + 3, 1).h("ab", 2)
+			 , "[        001a2b|3c    |ab]");
+		TEST1(fmt("%h").h(seq.data(), seq.size())
+			 , "00070e151c232a31383f464d545b626970777e858c939aa1a8afb6bdc4cbd2d9e0e7eef5fc030a11");
+		TEST1(fmt("%#h").h("hello world\n", 12)
+			 , "00000000  68 65 6c 6c 6f 20 77 6f  72 6c 64 0a              |hello world.|\n"
+			   "0000000c\n");
+		TEST1(fmt("%#H").h(seq.data() + 2, 20)
+			 , "00000000  0E 15 1C 23 2A 31 38 3F  46 4D 54 5B 62 69 70 77  |...#*18?FMT[bipw|\n"
+			   "00000010  7E 85 8C 93                                       |~...|\n"
+			   "00000014\n");
+	}
+
+	// y, Y
+
+	TEST1(fmt("%y|%y|%y|%y|%y|%y|%y|").s("").s("f").s("fo").s("foo").s("foob").s("fooba").s("foobar")
+		 , "|Zg==|Zm8=|Zm9v|Zm9vYg==|Zm9vYmE=|Zm9vYmFy|");
+	TEST1(fmt("%y|%Y|%Y|%Y").h("\xfb\xff", 2).h("\xfb\xff", 2).s("f").s_ref(std::string_view("fo"))
+		 , "+/8=|-_8|Zg|Zm8");
+	TEST1(fmt("[%10y|%-8Y|%y]").s("foo").s("fo").s("The quick brown fox jumps over the lazy dog")
+		 , "[      Zm9v|Zm8     |VGhlIHF1aWNrIGJyb3duIGZveCBqdW1wcyBvdmVyIHRoZSBsYXp5IGRvZw==]");
+
+	// decimal
+
+	{
+		using strformat_ns::decimal;
+		TEST1(fmt("%f|%f|%f|%.1f|%.4f|%.0f").f(decimal(12345, 2)).f(decimal(-5, 2)).f(decimal(7, 0)).f(decimal(12345, 2)).f(decimal(12345, 2)).f(decimal(-999, 3))
+			 , "123.45|-0.05|7|123.4|123.4500|-1");
+		TEST1(fmt("%.2f|%.2f|%.1f|%.0f|%.0f").f(decimal(125, 3)).f(decimal(135, 3)).f(decimal(-25, 2)).f(decimal(5, 1)).f(decimal(15, 1))
+			 , "0.12|0.14|-0.2|0|2");
+		TEST1(fmt("[%+f|%010.2f|%-8f|%+09f]").f(decimal(1, 1)).f(decimal(-314159, 5)).f(decimal(0, 3)).f(decimal(-1, 4))
+			 , "[+0.1|-000003.14|0.000   |-000.0001]");
+		TEST1(fmt("%f|%f|%.18f|%s")(decimal(INT64_MIN, 18)).f(decimal(INT64_MAX, 0)).f(decimal(1, 18)).f(decimal(-1234, 1))
+			 , "-9.223372036854775808|9223372036854775807|0.000000000000000001|-123.4");
+		strformat_ns::locale_snapshot de(",", ".", "\3");
+		TEST1(fmt("%'.2f").set_locale(&de).f(decimal(123456789, 2))
+			 , "1.234.567,89");
+	}
+
+	// a, A
+
+#ifndef STRFORMAT_NO_FP
+	TEST1(fmt("%a|%a|%a|%A|%a|%a").f(1).f(3).f(-0.1).f(255.5).f(0.0).f(-0.0)
+		 , "0x1p+0|0x1.8p+1|-0x1.999999999999ap-4|0X1.FFP+7|0x0p+0|-0x0p+0");
+	TEST1(fmt("%a|%a|%a|%a|%a").f(DBL_MAX).f(DBL_MIN).f(DBL_TRUE_MIN).f(INFINITY).f(-INFINITY)
+		 , "0x1.fffffffffffffp+1023|0x1p-1022|0x0.0000000000001p-1022|#INF|-#INF");
+	TEST1(fmt("%.0a|%.0a|%.1a|%.3a|%#.0a|%.15a").f(1.5).f(1.0).f(1.96875).f(1.0).f(1.0).f(1.0)
+		 , "0x2p+0|0x1p+0|0x2.0p+0|0x1.000p+0|0x1.p+0|0x1.000000000000000p+0");
+	TEST1(fmt("[%12a|%-8a|%+a|%012a]|%a|%a").f(2).f(0.5).f(1).f(-1).d(10).s("0x1.8p1")
+		 , "[      0x1p+1|0x1p-1  |+0x1p+0|-0x000001p+0]|0x1.4p+3|0x1.8p+1");
+	{
+		char *end;
+		double v1 = strformat_ns::misc::my_strtod("-0x1.999999999999ap-4 tail", &end);
+		double v2 = strformat_ns::misc::my_strtod(" 0X1P-1074", nullptr);
+		double v3 = strformat_ns::misc::my_strtod("0x1.00000000000008p+0", nullptr);	// tie, rounds to even
+		double v4 = strformat_ns::misc::my_strtod("0x1.000000000000080001p+0", nullptr);	// above the tie
+		double v5 = strformat_ns::misc::my_strtod("-#INF", nullptr);
+		TEST1(fmt("%d|%s|%d|%d|%d|%d|%d").d(v1 == -0.1).s(end).d(v2 == DBL_TRUE_MIN).d(v3 == 1.0).d(v4 == 1.0 + DBL_EPSILON).d(v5 == -INFINITY).d(std::isnan(strformat_ns::misc::my_strtod("#NAN", nullptr)))
+			 , "1| tail|1|1|1|1|1");
+	}
+#endif
+
+	// b
+
+	TEST1(fmt("%b|%b|%b|%B|%lb|%b").d(0).d(1).d(5).u(0xa5).ld(-1).d(-1)
+		 , "0|1|101|10100101|1111111111111111111111111111111111111111111111111111111111111111|11111111111111111111111111111111");
+	TEST1(fmt("[%8b|%-8b|%08b|%'b|%'b|%'lb]").d(5).d(5).d(5).u(0x1ff).u(0xf).lu(0x8000000000000001)
+		 , "[     101|101     |00000101|1_1111_1111|1111|1000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0001]");
+	TEST1(fmt("%b|%lb|%b|%b").s("10").s("0x100000000").x(255).c('A')
+		 , "1010|100000000000000000000000000000000|11111111|1000001");
+
+	// lld, llu
+
+#ifdef STRFORMAT_INT128
+	{
+		using strformat_ns::int128_t;
+		using strformat_ns::uint128_t;
+		uint128_t max = ~uint128_t(0);
+		int128_t min = int128_t(max >> 1) * -1 - 1;
+		TEST1(fmt("%lld|%lld|%+lld|%llu|%lld").lld(0).lld(-1).lld(42).llu(max).lld(min)
+			 , "0|-1|+42|340282366920938463463374607431768211455|-170141183460469231731687303715884105728");
+		TEST1(fmt("%llu|%llu|%llu").llu(uint128_t(1) << 64).llu(uint128_t(10000000000000000000ull) * 10000000000000000000ull).llu(uint128_t(10000000000000000000ull) * 10000000000000000000ull - 1)
+			 , "18446744073709551616|100000000000000000000000000000000000000|99999999999999999999999999999999999999");
+		TEST1(fmt("%llx|%llX|%llo|%llx|%lld").llu(max).llu(uint128_t(0xabc) << 64 | 0x1f).llu(max).lld(-1).llu(max)
+			 , "ffffffffffffffffffffffffffffffff|ABC000000000000001F|3777777777777777777777777777777777777777777|ffffffffffffffffffffffffffffffff|-1");
+		TEST1(fmt("%llb|%'llb|%llb").llu(uint128_t(1) << 64 | 5).llu(uint128_t(0x12) << 64).lld(-1)
+			 , ("10000000000000000000000000000000000000000000000000000000000000101|1_0010_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000_0000|" + std::string(128, '1')).c_str());
+		TEST1(fmt("[%40lld|%-6llu|%041lld]")(int128_t(-5)).llu(7).lld(min)
+			 , "[                                      -5|7     |-0170141183460469231731687303715884105728]");
+	}
+#endif
+
+	// t, T
+
+	{
+		using strformat_ns::timestamp;
+		int64_t ns = 1700000000123456789;
+		TEST1(fmt("%t|%T|%.3T|%.9t").t(0).t(ns).t(ns).t(ns)
+			 , "1970-01-01T00:00:00|2023-11-14T22:13:20Z|2023-11-14T22:13:20.123Z|2023-11-14T22:13:20.123456789");
+		TEST1(fmt("%.6T|%T|%.1T").t(timestamp(ns, 9 * 60)).t(timestamp(ns, -(5 * 60 + 30))).t(-1)
+			 , "2023-11-15T07:13:20.123456+09:00|2023-11-14T16:43:20-05:30|1969-12-31T23:59:59.9Z");
+		TEST1(fmt("%T|%.2T|%d").t(std::chrono::system_clock::time_point(std::chrono::seconds(951782400))).t(timestamp(INT64_MIN)).t(1234)
+			 , "2000-02-29T00:00:00Z|1677-09-21T00:12:43.14Z|1234");
+		TEST1(fmt("[%24T|%-21t]").t(ns).t(ns)
+			 , "[    2023-11-14T22:13:20Z|2023-11-14T22:13:20  ]");
+	}
+
+	// format text is bounded by its length, not by NUL
+
+	{
+		static char const text[] = "ab%dcd%5d|%%|%-3s|zz";
+		TEST1(fmt(std::string_view(text, 4)).d(1)
+			 , "ab1");
+		TEST1(fmt(std::string_view(text, 3)).d(1)
+			 , "ab");
+		TEST1(fmt(std::string_view(text, 8)).d(1).d(2)
+			 , "ab1cd");
+		TEST1(fmt(fmt::Intern, std::string_view(text, 8)).d(1).d(2)
+			 , "ab1cd");
+		TEST1(fmt(std::string_view(text, 13)).d(1).d(2)
+			 , "ab1cd    2|%|");
+		TEST1(fmt("%d").d(fmt(std::string("x\0%d|y", 6)).d(7).str().size())
+			 , "5");
+		std::string big(300, 'L');
+		TEST1(fmt(big + "%d" + big + "%%").d(9)
+			 , (big + "9" + big + "%").c_str());
+	}
+
+	// s (borrowed)
+
+	TEST1(fmt("(%s)").s_ref("hoge")
+		 , "(hoge)");
+	TEST1(fmt("(%-10s|%10s)").s_ref(std::string_view("hogehoge", 4)).s_ref("fuga")
+		 , "(hoge      |      fuga)");
+	TEST1(fmt("(%05s)").s_ref("-12")
+		 , "(-0012)");
+	TEST1(fmt("(%d)").s_ref("123")
+		 , "(123)");
+	TEST1(fmt("%%(%s)%%").s_ref("")
+		 , "%()%");
+
+	// s (utf-8)
+
+	TEST1(fmt("(%-7s)").s("h\u00e9llo")
+		 , "(h\u00e9llo )");
+	TEST1(fmt(fmt::Utf8, "(%-7s)").s("h\u00e9llo")
+		 , "(h\u00e9llo  )");
+	TEST1(fmt(fmt::Utf8, "(%7s)").s(std::string("h\u00e9llo"))
+		 , "(  h\u00e9llo)");
+	TEST1(fmt(fmt::Utf8, "(%.3s)").s("h\u00e9llo")
+		 , "(h\u00e9l)");
+	TEST1(fmt(fmt::Utf8, "(%.2s)").s("abcdef")
+		 , "(ab)");
+	TEST1(fmt(fmt::Utf8, "(%6s)").s("\u65e5\u672c")
+		 , "(    \u65e5\u672c)");
+	TEST1(fmt(fmt::Utf8 | fmt::EastAsianWidth, "(%6s)").s("\u65e5\u672c")
+		 , "(  \u65e5\u672c)");
+	TEST1(fmt(fmt::Utf8 | fmt::EastAsianWidth, "(%-.3s)").s("\u65e5\u672c\u8a9e")
+		 , "(\u65e5)");
+	TEST1(fmt(fmt::Utf8 | fmt::EastAsianWidth, "(%3s)").s("e\u0301")
+		 , "(  e\u0301)");
+	TEST1(fmt(fmt::Utf8, "(%4s)").s("a\xff" "b")
+		 , "( a\xff" "b)");
+	TEST1(fmt(fmt::Utf8 | fmt::ReplaceInvalid, "(%4s)").s("a\xff" "b")
+		 , "( a\ufffd" "b)");
+	TEST1(fmt(fmt::Utf8 | fmt::ReplaceInvalid, "(%s)").s("a\xed\xa0\x80" "b\xe6\x97")
+		 , "(a\ufffd\ufffd\ufffd" "b\ufffd)");
+	TEST1(fmt(fmt::Utf8 | fmt::ReplaceInvalid, "(%-20s)").s("0123456789abcdef\u00e9")
+		 , "(0123456789abcdef\u00e9   )");
+
 	// p
 
 	TEST2(fmt("(%p)").p((void *)0)
@@ -604,3 +1050,723 @@ void test()
 		 , "(N)");
 }
 
+void test_reuse()
+{
+	// a formatter reused with reset() must reach a steady state
+	std::string payload(1000, 'x');
+	fmt f;
+	size_t usage = 0;
+	bool ok = true;
+	for (int i = 0; i < 1000000; i++) {
+		f.reset(0, "(%s|%d|%-20s|%s)");
+		f.s("hoge").d(i).s("fuga").s(payload);
+		if (f.length() != 1029 + (int)std::to_string(i).size()) {
+			ok = false;
+		}
+		if (i == 10) {
+			usage = f.memory_usage();
+		}
+	}
+	TEST1(fmt("%d").d(ok)
+		 , "1");
+	TEST1(fmt("%s").s(usage > 0 && f.memory_usage() == usage ? "flat" : "growing")
+		 , "flat");
+	TEST1(f
+		 , ("(hoge|999999|fuga                |" + payload + ")").c_str());
+}
+
+template <typename F> std::string move_partial(F &f)
+{
+	F g(std::move(f));
+	return g.d(-12).s("tail").str();
+}
+
+void test_move()
+{
+	std::string big(500, 'y');
+
+	// parts in the inline buffer and in heap chunks, source destroyed first
+	{
+		fmt *f = new fmt("(%s|%s|%05d|%s)");
+		f->s("hoge").s(big);
+		fmt g(std::move(*f));
+		delete f;
+		TEST1(g.d(-12).s("tail")
+			 , ("(hoge|" + big + "|-0012|tail)").c_str());
+	}
+
+	// move assignment, then reuse of the moved-from formatter
+	{
+		fmt f("(%-6s|%s|%d)");
+		f.s("ab").s(big);
+		fmt g("unused %d");
+		g.d(1);
+		g = std::move(f);
+		TEST1(g.d(3)
+			 , ("(ab    |" + big + "|3)").c_str());
+		TEST1(f.reset(0, "%d").d(4)
+			 , "4");
+	}
+
+	// hand a partially built formatter to another thread
+	{
+		fmt f("[%s] %s=%d");
+		f.s("main").s("key");
+		std::string result;
+		std::thread th([&result](fmt g){
+			result = g.d(42).str();
+		}, std::move(f));
+		th.join();
+		TEST1(fmt("%s").s(result)
+			 , "[main] key=42");
+	}
+
+	// registry counts of a finished thread stay visible to the others
+	{
+		static char const text[] = "<%d>";
+		strformat_ns::format_registry::intern(text);
+		uint64_t hits = strformat_ns::format_registry::this_thread_hits();
+		uint64_t total = strformat_ns::format_registry::hits();
+		std::thread th([](){
+			for (int i = 0; i < 3; i++) {
+				fmt(fmt::Intern, text).d(i).str();
+			}
+		});
+		th.join();
+		TEST1(fmt("%d|%d").d(strformat_ns::format_registry::this_thread_hits() - hits).d(strformat_ns::format_registry::hits() - total >= 3)
+			 , "0|1");
+	}
+
+	// other policies
+	TEST1(fmt("%s").s(move_partial(strformat_ns::fixed_formatter<512>("(%s|%05d|%s)").s("fixed")))
+		 , "(fixed|-0012|tail)");
+	TEST1(fmt("%s").s(move_partial(strformat_ns::basic_string_formatter<strformat_ns::StdAlloc>("(%s|%05d|%s)").s("std")))
+		 , "(std|-0012|tail)");
+	TEST1(fmt("%s").s(move_partial(strformat_ns::pmr_string_formatter("(%s|%05d|%s)").s("pmr")))
+		 , "(pmr|-0012|tail)");
+}
+
+/**
+ * @brief Output of every conversion letter for each argument type.
+ *
+ * Pins the per-type conversion routes.  Only exactly representable numbers
+ * are parsed from text, so the result does not depend on my_strtod rounding.
+ */
+void test_dispatch()
+{
+	// conversions that format every argument type alike share a row
+	static struct {
+		char const *convs;
+		char const *ints;
+		char const *longs;
+		char const *texts;
+		char const *reals;
+		char const *negative_reals; // nullptr: converting a negative double is undefined for this conversion
+	} const expected[] = {
+		{ "a",
+		  "0x1.04p+6|-0x1.02p+7|-0x1.000p+63|0x1p+64|0x1.fp+4",
+		  "0x1.fffffffep+31|0x1.d1a94a2p+39|+0x2.000p+31|0x1p+63|000000007FFFFFFF",
+		  "0x1.04p+6|-0x1p+0|+0x1.900p+3|0x0p+0|(null)",
+		  "0x0p+0|0x1.8p+0|+0x1.07ap+6|0x1.91p+6|0x1.fcp+6",
+		  "-0x1.6p+1|-0x1.8ep+6|-0x1.2a0p+33|-0x1p-1|-0x1.fcp+6" },
+		{ "bB",
+		  "1000001|11111111111111111111111101111111|1000000000000000000000000000000000000000000000000000000000000000|1111111111111111111111111111111111111111111111111111111111111111|11111",
+		  "11111111111111111111111111111111|1110100011010100101001010001000000000000|11111111111111111111111111111111|111111111111111111111111111111111111111111111111111111111111111|000000007FFFFFFF",
+		  "1000001|1111111111111111111111111111111111111111111111111111111111111111|    1100|0     |(null)",
+		  "0|1| 1000001|1100100|1111111",
+		  nullptr },
+		{ "cC",
+		  "A|<7f>|       <00>|<ff>     |<1f>",
+		  "<ff>|<00>|       <ff>|<ff>     |000000007FFFFFFF",
+		  "A|<ff>|       <0c>|<00>     |(null)",
+		  "<00>|<01>|       A|d     |<7f>",
+		  nullptr },
+		{ "dD",
+		  "65|-129|-9223372036854775808|-1    |31",
+		  "-1|1000000000000|      -1|9223372036854775807|000000007FFFFFFF",
+		  "65|-1|     +12|0     |(null)",
+		  "0|1|     +65|100   |127",
+		  "-2|-99|-10000000000|0     |-127" },
+		{ "eghijkmnpqrtvwz",
+		  "65|-129|-9223372036854775808|18446744073709551615|1f",
+		  "4294967295|16432451210000|37777777777|7fffffffffffffff|000000007FFFFFFF",
+		  "65|-1|    12.5|abc   |(null)",
+		  "0.000000|1.500000| +65.900|100.250000|127.000000",
+		  "-2.750000|-99.500000|-10000000000.000|-0.500000|-127.000000" },
+		{ "fF",
+		  "65.000000|-129.000000|-9223372036854775808.000|18446744073709551616.000000|31.000000",
+		  "4294967295.000000|1000000000000.000000|+4294967295.000|9223372036854775808.000000|000000007FFFFFFF",
+		  "65.000000|-1.000000| +12.500|0.000000|(null)",
+		  "0.000000|1.500000| +65.900|100.250000|127.000000",
+		  "-2.750000|-99.500000|-10000000000.000|-0.500000|-127.000000" },
+		{ "l",
+		  "||||",
+		  "||||",
+		  "||||",
+		  "||||",
+		  "||||" },
+		{ "oO",
+		  "101|37777777577|1000000000000000000000|1777777777777777777777|37",
+		  "37777777777|16432451210000|37777777777|777777777777777777777|000000007FFFFFFF",
+		  "101|1777777777777777777777|      14|0     |(null)",
+		  "0|1|     101|144   |177",
+		  nullptr },
+		{ "s",
+		  "65|-129|-9223372036854775808|18446744073709551615|1f",
+		  "4294967295|16432451210000|37777777777|7fffffffffffffff|000000007FFFFFFF",
+		  "65|-1|    12.5|abc   |(null)",
+		  "0|1.5|   +65.9|100.25|127",
+		  "-2.75|-99.5|-10000000000|-0.5  |-127" },
+		{ "uU",
+		  "65|4294967167|9223372036854775808|18446744073709551615|31",
+		  "4294967295|1000000000000|4294967295|9223372036854775807|000000007FFFFFFF",
+		  "65|18446744073709551615|      12|0     |(null)",
+		  "0|1|      65|100   |127",
+		  nullptr },
+		{ "x",
+		  "41|ffffff7f|8000000000000000|ffffffffffffffff|1f",
+		  "ffffffff|e8d4a51000|ffffffff|7fffffffffffffff|000000007FFFFFFF",
+		  "41|ffffffffffffffff|       c|0     |(null)",
+		  "0|1|      41|64    |7f",
+		  nullptr },
+		{ "y",
+		  "65|-129|-9223372036854775808|18446744073709551615|1f",
+		  "4294967295|16432451210000|37777777777|7fffffffffffffff|000000007FFFFFFF",
+		  "NjU=|LTE=|MTIuNQ==|YWJj  |(null)",
+		  "0.000000|1.500000| +65.900|100.250000|127.000000",
+		  "-2.750000|-99.500000|-10000000000.000|-0.500000|-127.000000" },
+		{ "A",
+		  "0X1.04P+6|-0X1.02P+7|-0X1.000P+63|0X1P+64|0X1.FP+4",
+		  "0X1.FFFFFFFEP+31|0X1.D1A94A2P+39|+0X2.000P+31|0X1P+63|000000007FFFFFFF",
+		  "0X1.04P+6|-0X1P+0|+0X1.900P+3|0X0P+0|(null)",
+		  "0X0P+0|0X1.8P+0|+0X1.07AP+6|0X1.91P+6|0X1.FCP+6",
+		  "-0X1.6P+1|-0X1.8EP+6|-0X1.2A0P+33|-0X1P-1|-0X1.FCP+6" },
+		{ "EGHIJKLMNPQRTVWZ",
+		  "65|-129|-9223372036854775808|18446744073709551615|1F",
+		  "4294967295|16432451210000|37777777777|7FFFFFFFFFFFFFFF|000000007FFFFFFF",
+		  "65|-1|    12.5|abc   |(null)",
+		  "0.000000|1.500000| +65.900|100.250000|127.000000",
+		  "-2.750000|-99.500000|-10000000000.000|-0.500000|-127.000000" },
+		{ "S",
+		  "65|-129|-9223372036854775808|18446744073709551615|1F",
+		  "4294967295|16432451210000|37777777777|7FFFFFFFFFFFFFFF|000000007FFFFFFF",
+		  "65|-1|    12.5|abc   |(null)",
+		  "0|1.5|   +65.9|100.25|127",
+		  "-2.75|-99.5|-10000000000|-0.5  |-127" },
+		{ "X",
+		  "41|FFFFFF7F|8000000000000000|ffffffffffffffff|1F",
+		  "FFFFFFFF|E8D4A51000|FFFFFFFF|7FFFFFFFFFFFFFFF|000000007FFFFFFF",
+		  "41|ffffffffffffffff|       C|0     |(null)",
+		  "0|1|      41|64    |7F",
+		  nullptr },
+		{ "Y",
+		  "65|-129|-9223372036854775808|18446744073709551615|1F",
+		  "4294967295|16432451210000|37777777777|7FFFFFFFFFFFFFFF|000000007FFFFFFF",
+		  "NjU|LTE|  MTIuNQ|YWJj  |(null)",
+		  "0.000000|1.500000| +65.900|100.250000|127.000000",
+		  "-2.750000|-99.500000|-10000000000.000|-0.500000|-127.000000" },
+	};
+	auto Visible = [](std::string const &s){
+		std::string r;
+		for (unsigned char c : s) {
+			if (c < 0x20 || c >= 0x7f) {
+				r += fmt("<%02x>").x(c).str();
+			} else {
+				r += (char)c;
+			}
+		}
+		return r;
+	};
+	auto Check = [&](std::string const &text, fmt &f, char const *answer){
+		test_(text.c_str(), Visible(f.str()), answer, nullptr, __FILE__, __LINE__);
+	};
+	for (auto const &e : expected) {
+		for (char const *conv = e.convs; *conv; conv++) {
+			std::string text = std::string("%") + *conv + "|%l" + *conv + "|%+8.3" + *conv + "|%-6" + *conv + "|%" + *conv;
+			char const *t = text.c_str();
+			{ fmt f(t); f.c('A').d(-129).ld(INT64_MIN).lu(UINT64_MAX).x(0x1f); Check(text, f, e.ints); }
+			{ fmt f(t); f.u(4294967295u).lo(1000000000000).o(-1).lx(INT64_MAX).p((void *)0x7fffffff); Check(text, f, e.longs); }
+			{ fmt f(t); f.s("65").s(std::string_view("-1")).s_ref("12.5")(std::string("abc")).s((char const *)nullptr); Check(text, f, e.texts); }
+#ifndef STRFORMAT_NO_FP
+			{ fmt f(t); f.f(0).f(1.5).f(65.9).f(100.25).f(127); Check(text, f, e.reals); }
+			if (e.negative_reals) {
+				fmt f(t);
+				f.f(-2.75).f(-99.5).f(-1e10).f(-0.5).f(-127);
+				Check(text, f, e.negative_reals);
+			}
+#endif
+		}
+	}
+}
+
+#ifndef STRFORMAT_NO_FP
+/**
+ * @brief Differential test of the %.Nf fast path against to_chars().
+ */
+void test_fixed()
+{
+	XorShift64 Random(0x9e3779b97f4a7c15);
+	int checked = 0;
+	Mismatches mismatches;
+	auto Check = [&](double v, int precision){
+		char a[32];
+		char b[512];
+		char *e = strformat_ns::misc::format_fixed_small(a, v, precision);
+		if (!e) return;
+		auto r = std::to_chars(b, b + sizeof(b), v, std::chars_format::fixed, precision);
+		checked++;
+		mismatches.check(std::string_view(a, e - a), std::string_view(b, r.ptr - b), [&](){
+			char tmp[64];
+			snprintf(tmp, sizeof(tmp), "%.17g, precision %d", v, precision);
+			return std::string(tmp);
+		});
+	};
+	for (int i = 0; i < 1000000; i++) {
+		uint64_t x = Random();
+		int precision = int(x % 16);
+		double v;
+		switch ((x >> 4) % 4) {
+		case 0:
+			// any bit pattern within the range
+			v = std::ldexp(double(Random() >> 11), int((x >> 8) % 100) - 100);
+			break;
+		case 1:
+			// exact ties and their neighbours: k / 2^m
+			v = std::ldexp(double(Random() % 100000000), -int((x >> 8) % 12));
+			if (x & (1 << 20)) v = std::nextafter(v, 0.0);
+			if (x & (1 << 21)) v = std::nextafter(v, 1e300);
+			break;
+		case 2:
+			// short decimals, the common case
+			v = double(Random() % 10000000) / std::pow(10.0, double((x >> 8) % 8));
+			break;
+		default:
+			// the 2^52 boundary
+			v = std::nextafter(4503599627370496.0 / std::pow(10.0, precision), (x & 256) ? 0.0 : 1e300);
+			break;
+		}
+		Check(v, precision);
+	}
+	TEST_MISMATCHES(mismatches);
+	TEST1(fmt("%d").d(checked > 500000)
+		 , "1");
+	TEST1(fmt("%.2f|%.3f|%.0f|%.0f|%.1f|%.2f").f(0.125).f(2.0005).f(2.5).f(3.5).f(-0.05).f(-0.0)
+		 , "0.12|2.001|2|4|-0.1|-0.00");
+
+	// batched columns against one .f() per element
+	Mismatches batch;
+	std::vector<double> column;
+	for (int i = 0; i < 4000; i++) {
+		uint64_t x = Random();
+		double v;
+		switch (x % 8) {
+		case 0: v = std::ldexp(double(Random() >> 11), int((x >> 8) % 120) - 100); break;
+		case 1: v = double(Random() % 10000000) / 1000; break;
+		case 2: v = std::ldexp(double(Random() % 100000000), -int((x >> 8) % 12)); break;
+		case 3: v = (x >> 8) % 2 ? NAN : INFINITY; break;
+		case 4: v = (x >> 8) % 2 ? 0.0 : 1e300; break;
+		case 5: v = std::nextafter(4503599627370496.0 / std::pow(10.0, double((x >> 8) % 16)), (x & 256) ? 0.0 : 1e300); break;
+		default: v = double(int64_t(Random() % 2000001) - 1000000) / 64; break;
+		}
+		column.push_back((x >> 16) % 3 ? v : -v);
+	}
+	for (int precision = 0; precision <= 17; precision++) {
+		for (int plus = 0; plus < 2; plus++) {
+			for (size_t n : { size_t(0), size_t(1), size_t(7), column.size() }) {
+				std::string expected;
+				for (size_t i = 0; i < n; i++) {
+					if (i > 0) expected += ", ";
+					expected += fmt(plus ? "%+.*f" : "%.*f").f(column[i], -1, precision).str();
+				}
+				std::vector<char> buf(strformat_ns::misc::fixed_array_bound(column.data(), n, precision, 2));
+				char *end = strformat_ns::misc::write_fixed_array(buf.data(), column.data(), n, precision, ", ", plus != 0);
+				batch.check(std::string_view(buf.data(), end - buf.data()), expected, [&](){
+					return fmt("precision %d, plus %d, %lu values").d(precision).d(plus).lu(n).str();
+				});
+			}
+		}
+	}
+	TEST_MISMATCHES(batch);
+}
+#endif
+
+/**
+ * @brief Batch integer kernels: every value below 10^8, then random values.
+ */
+void test_array()
+{
+	char buf[64];
+	Mismatches mismatches;
+	for (uint32_t v = 0; v < 100000000; v++) {
+		char *end = strformat_ns::misc::write_uint64(buf, v);
+		uint32_t r = 0;
+		for (char *p = buf; p < end; p++) {
+			r = r * 10 + uint32_t(*p - '0');
+		}
+		if (r != v || (end - buf > 1 && buf[0] == '0')) {
+			mismatches.fail(std::to_string(v), std::string_view(buf, end - buf), std::to_string(v));
+		}
+	}
+	XorShift64 Random(0x2545f4914f6cdd1d);
+	for (int i = 0; i < 200000; i++) {
+		uint64_t x = Random();
+		int64_t v = int64_t(x >> (x % 64));
+		if (i & 1) v = -v;
+		for (int hex = 0; hex < 2; hex++) {
+			char *end = strformat_ns::misc::write_array(buf, &v, 1, ",", hex != 0);
+			std::string expected = hex ? fmt("%lx").lx(v).str() : fmt("%ld").ld(v).str();
+			mismatches.check(std::string_view(buf, end - buf), expected, [&](){
+				return fmt(hex ? "int64 %ld, hex" : "int64 %ld").ld(v).str();
+			});
+		}
+		uint32_t u = uint32_t(x);
+		char *end = strformat_ns::misc::write_array(buf, &u, 1, ",");
+		mismatches.check(std::string_view(buf, end - buf), fmt("%u").u(u).str(), [&](){
+			return fmt("uint32 %u").u(u).str();
+		});
+	}
+	TEST_MISMATCHES(mismatches);
+}
+
+/**
+ * @brief csv_writer against the same fields formatted one by one.
+ */
+void test_csv()
+{
+	using strformat_ns::csv_writer;
+	auto Read = [](FILE *fp){
+		std::string s;
+		rewind(fp);
+		char tmp[4096];
+		size_t n;
+		while ((n = fread(tmp, 1, sizeof(tmp), fp)) > 0) {
+			s.append(tmp, n);
+		}
+		fclose(fp);
+		return s;
+	};
+
+#ifndef STRFORMAT_NO_FP
+	{
+		FILE *fp = tmpfile();
+		{
+			csv_writer csv(fp);
+			csv.columns({ "%d", "%s", "%.3f", "%x", "%5d", "%X", "id-%u" });
+			csv.header({ "id", "name, full", "score", "hex", "pad", "HEX", "tag" });
+			csv.row(1, "alice", 0.5, 255, 7, uint64_t(0xabc), 9u);
+			csv.row(-2, std::string("say \"hi\""), -1.0 / 3, -1, -7, -1, 10u);
+			csv.row(int64_t(-9223372036854775807 - 1), "line\nbreak", NAN, int64_t(-1), 123456, int64_t(-1));
+			csv.row(true, 'c', 2.5f, (char const *)nullptr);
+		}
+		TEST1(fmt("%s").s(Read(fp))
+			 , "id,\"name, full\",score,hex,pad,HEX,tag\n"
+			   "1,alice,0.500,ff,    7,abc,id-9\n"
+			   "-2,\"say \"\"hi\"\"\",-0.333,ffffffff,   -7,FFFFFFFF,id-10\n"
+			   "-9223372036854775808,\"line\nbreak\",#NAN,ffffffffffffffff,123456,FFFFFFFFFFFFFFFF\n"
+			   "1,99,2.500,\n");
+	}
+
+	// every field matches string_formatter; a small buffer forces many flushes
+	{
+		FILE *fp = tmpfile();
+		std::string expected;
+		{
+			csv_writer csv(fp, '\t', 64);
+			csv.columns({ "%d", "%lu", "%08.2f", "%-6s", "%x", "%+d" });
+			for (int i = 0; i < 2000; i++) {
+				int32_t a = i * 7919 - 5000000;
+				uint64_t b = uint64_t(i) * 0x9e3779b97f4a7c15;
+				double c = (i - 1000) / 3.0;
+				std::string d(size_t(i % 40), char('a' + i % 26));
+				if (i % 5 == 0) d += "\tx";
+				std::string row = fmt("%d\t%lu\t%08.2f\t").d(a).lu(b).f(c).str();
+				std::string s = fmt("%-6s").s(d).str();
+				if (s.find('\t') != std::string::npos) s = "\"" + s + "\"";
+				row += s + fmt("\t%x\t%+d\n").x(a).d(a).str();
+				expected += row;
+				csv.row(a, b, c, d, a, a);
+			}
+			TEST1(fmt("%d").d(csv.flush() && csv.rows() == 2000)
+				 , "1");
+		}
+		std::string out = Read(fp);
+		TEST1(fmt("%d").d(out == expected)
+			 , "1");
+	}
+#endif
+
+	std::string probe(40, 'x');
+	int quoted = 0;
+	for (size_t i = 0; i < probe.size(); i++) {
+		for (char c : { ',', '"', '\r', '\n' }) {
+			std::string s = probe;
+			s[i] = c;
+			quoted += csv_writer::needs_quoting(s.data(), s.size(), ',');
+		}
+	}
+	TEST1(fmt("%d|%d").d(quoted).d(csv_writer::needs_quoting(probe.data(), probe.size(), ','))
+		 , "160|0");
+}
+
+/**
+ * @brief Every length and grouping of "%h" and "%#h" against a byte-wise
+ *        reference.
+ */
+void test_hex()
+{
+	std::vector<unsigned char> buf(300);
+	for (size_t i = 0; i < buf.size(); i++) {
+		buf[i] = (unsigned char)(i * 37 + 11);
+	}
+	auto Hex = [&](size_t n, size_t group, char sep, bool upper){
+		std::string s;
+		for (size_t i = 0; i < n; i++) {
+			if (group > 0 && i > 0 && i % group == 0) s += sep;
+			char tmp[4];
+			snprintf(tmp, sizeof(tmp), upper ? "%02X" : "%02x", buf[i]);
+			s += tmp;
+		}
+		return s;
+	};
+	auto Dump = [&](size_t n){
+		std::string s;
+		for (size_t off = 0; off < n; off += 16) {
+			char tmp[32];
+			snprintf(tmp, sizeof(tmp), "%08zx  ", off);
+			s += tmp;
+			std::string ascii;
+			for (size_t i = 0; i < 16; i++) {
+				if (i == 8) s += ' ';
+				if (off + i < n) {
+					unsigned char c = buf[off + i];
+					snprintf(tmp, sizeof(tmp), "%02x ", c);
+					s += tmp;
+					ascii += c >= 0x20 && c < 0x7f ? char(c) : '.';
+				} else {
+					s += "   ";
+				}
+			}
+			s += " |" + ascii + "|\n";
+		}
+		if (n > 0) {
+			char tmp[32];
+			snprintf(tmp, sizeof(tmp), "%08zx\n", n);
+			s += tmp;
+		}
+		return s;
+	};
+	Mismatches mismatches;
+	for (size_t n = 0; n <= buf.size(); n++) {
+		auto Input = [&](char const *spec, int group){
+			return fmt("%s of %lu bytes, group %d").s(spec).lu(n).d(group).str();
+		};
+		mismatches.check(fmt("%h").h(buf.data(), n).str(), Hex(n, 0, 0, false), [&](){ return Input("%h", 0); });
+		mismatches.check(fmt("%H").h(buf.data(), n).str(), Hex(n, 0, 0, true), [&](){ return Input("%H", 0); });
+		mismatches.check(fmt("%#h").h(buf.data(), n).str(), Dump(n), [&](){ return Input("%#h", 0); });
+		for (int group : { 1, 2, 5, 16, 17 }) {
+			std::string s = fmt("%.*h")(strformat_ns::byte_span(buf.data(), n, ':'), -1, group).str();
+			mismatches.check(s, Hex(n, group, ':', false), [&](){ return Input("%.*h", group); });
+		}
+	}
+	TEST_MISMATCHES(mismatches);
+}
+
+/**
+ * @brief "%y" and "%Y" for every length up to a few blocks against a
+ *        bit-by-bit reference.
+ */
+void test_base64()
+{
+	std::vector<unsigned char> buf(200);
+	for (size_t i = 0; i < buf.size(); i++) {
+		buf[i] = (unsigned char)(i * 97 + 3);
+	}
+	auto Encode = [&](size_t n, bool url){
+		char const *table = url
+			? "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+			: "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		std::string s;
+		for (size_t bit = 0; bit < n * 8; bit += 6) {
+			int v = 0;
+			for (size_t k = bit; k < bit + 6; k++) {
+				v = v * 2 + (k < n * 8 ? (buf[k / 8] >> (7 - k % 8)) & 1 : 0);
+			}
+			s += table[v];
+		}
+		while (!url && s.size() % 4 != 0) s += '=';
+		return s;
+	};
+	Mismatches mismatches;
+	for (size_t n = 0; n <= buf.size(); n++) {
+		std::string_view text((char const *)buf.data(), n);
+		auto Input = [&](char const *what){
+			return fmt("%s of %lu bytes").s(what).lu(n).str();
+		};
+		mismatches.check(fmt("%y").h(buf.data(), n).str(), Encode(n, false), [&](){ return Input("%y"); });
+		mismatches.check(fmt("%Y").h(buf.data(), n).str(), Encode(n, true), [&](){ return Input("%Y"); });
+		mismatches.check(fmt("%y").s_ref(text).str(), Encode(n, false), [&](){ return Input("%y (text)"); });
+		mismatches.check(std::to_string(strformat_ns::base64::size(n, true)), std::to_string(Encode(n, false).size()), [&](){ return Input("size(padded)"); });
+		mismatches.check(std::to_string(strformat_ns::base64::size(n, false)), std::to_string(Encode(n, true).size()), [&](){ return Input("size(unpadded)"); });
+	}
+	TEST_MISMATCHES(mismatches);
+}
+
+/**
+ * @brief "%T" against gmtime_r() over a wide range, with runs of
+ *        timestamps in the same second to exercise the per-thread cache.
+ */
+void test_timestamp()
+{
+	XorShift64 Random(0x2545f4914f6cdd1d);
+	Mismatches mismatches;
+	for (int i = 0; i < 20000; i++) {
+		int64_t sec = int64_t(Random() % 15000000000) - 6000000000; // 1779 to 2255
+		for (int j = 0; j < 3; j++) {
+			int frac = int(Random() % 1000000000);
+			int offset = int(Random() % 1681) - 840;
+			time_t t = time_t(sec + offset * 60);
+			struct tm tm;
+			gmtime_r(&t, &tm);
+			char expected[64];
+			size_t n = strftime(expected, sizeof(expected), "%Y-%m-%dT%H:%M:%S", &tm);
+			snprintf(expected + n, sizeof(expected) - n, ".%06d%c%02d:%02d", frac / 1000, offset < 0 ? '-' : '+', std::abs(offset) / 60, std::abs(offset) % 60);
+			if (offset == 0) strcpy(expected + n + 7, "Z");
+			std::string s = fmt("%.6T").t(strformat_ns::timestamp(sec * 1000000000 + frac, offset)).str();
+			mismatches.check(s, expected, [&](){
+				return fmt("%ld s + %d ns, offset %d").ld(sec).d(frac).d(offset).str();
+			});
+		}
+	}
+	TEST_MISMATCHES(mismatches);
+}
+
+/**
+ * @brief decimal against rounding the exact digit string by hand.
+ */
+void test_decimal()
+{
+	XorShift64 Random(0x853c49e6748fea9b);
+	auto Reference = [](int64_t value, int scale, int precision){
+		uint64_t mag = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+		std::string digits = std::to_string(mag);
+		if ((int)digits.size() <= scale) digits.insert(0, scale + 1 - digits.size(), '0');
+		std::string ip = digits.substr(0, digits.size() - scale);
+		std::string fp = digits.substr(digits.size() - scale);
+		if (precision < scale) {
+			std::string kept = ip + fp.substr(0, precision);
+			std::string rest = fp.substr(precision);
+			bool up = rest[0] > '5' || (rest[0] == '5' && (rest.find_first_not_of('0', 1) != std::string::npos || (kept.back() - '0') % 2 == 1));
+			if (up) {
+				int i = (int)kept.size() - 1;
+				while (i >= 0 && kept[i] == '9') kept[i--] = '0';
+				if (i < 0) kept.insert(0, 1, '1'); else kept[i]++;
+			}
+			ip = kept.substr(0, kept.size() - precision);
+			fp = kept.substr(kept.size() - precision);
+		} else {
+			fp.append(precision - scale, '0');
+		}
+		return (value < 0 ? "-" : "") + ip + (precision > 0 ? "." + fp : "");
+	};
+	Mismatches mismatches;
+	for (int i = 0; i < 200000; i++) {
+		int64_t value = (int64_t)Random() >> (Random() % 64);
+		if (i % 4 == 0) value = value / 1000 * 1000 + 500; // ties
+		int scale = int(Random() % 19);
+		int precision = int(Random() % 22);
+		std::string s = fmt("%.*f").f(strformat_ns::decimal(value, scale), -1, precision).str();
+		mismatches.check(s, Reference(value, scale, precision), [&](){
+			return fmt("decimal(%ld, %d), precision %d").ld(value).d(scale).d(precision).str();
+		});
+	}
+	TEST_MISMATCHES(mismatches);
+}
+
+#ifdef STRFORMAT_INT128
+/**
+ * @brief 128-bit conversions against digit-at-a-time references.
+ */
+void test_int128()
+{
+	using strformat_ns::int128_t;
+	using strformat_ns::uint128_t;
+	XorShift64 Random(0xda942042e4dd58b5);
+	auto Digits = [](uint128_t v, int radix){
+		std::string s;
+		do {
+			s.insert(s.begin(), "0123456789abcdef"[int(v % radix)]);
+			v /= radix;
+		} while (v != 0);
+		return s;
+	};
+	std::vector<uint128_t> values;
+	for (int bits = 0; bits < 128; bits++) {
+		uint128_t p = uint128_t(1) << bits;
+		values.push_back(p - 1);
+		values.push_back(p);
+		values.push_back(p + 1);
+	}
+	uint128_t e = 1;
+	for (int i = 0; i <= 38; i++, e *= 10) {
+		values.push_back(e - 1);
+		values.push_back(e);
+	}
+	for (int i = 0; i < 20000; i++) {
+		uint128_t v = uint128_t(Random()) << 64 | Random();
+		values.push_back(v >> (Random() % 128));
+	}
+	Mismatches mismatches;
+	for (uint128_t v : values) {
+		int128_t sv = int128_t(v);
+		std::string sd = sv < 0 ? "-" + Digits(0 - v, 10) : Digits(v, 10);
+		std::string expected = Digits(v, 10) + "|" + sd + "|" + Digits(v, 16) + "|" + Digits(v, 8) + "|" + Digits(v, 2);
+		auto Input = [&](){
+			return "0x" + Digits(v, 16);
+		};
+		mismatches.check(fmt("%llu|%lld|%llx|%llo|%llb").llu(v).lld(sv).llu(v).llu(v).llu(v).str(), expected, Input);
+		mismatches.check(fmt("%lb").lu(uint64_t(v)).str(), Digits(uint64_t(v), 2), Input);
+		mismatches.check(fmt("%b").u(uint32_t(v)).str(), Digits(uint32_t(v), 2), Input);
+	}
+	TEST_MISMATCHES(mismatches);
+}
+#endif
+
+#ifndef STRFORMAT_NO_FP
+/**
+ * @brief "%a" against printf and round trips through my_strtod().
+ */
+void test_hexfloat()
+{
+	XorShift64 Random(0x6a09e667f3bcc909);
+	Mismatches mismatches;
+	Mismatches lossy;
+	for (int i = 0; i < 100000; i++) {
+		uint64_t bits = Random();
+		if (i % 8 == 0) bits &= 0x800fffffffffffff; // subnormals and zeros
+		double v;
+		memcpy(&v, &bits, 8);
+		if (!std::isfinite(v)) continue;
+		int precision = i % 3 == 0 ? int(Random() % 16) : -1;
+		char expected[64];
+		if (precision < 0) {
+			snprintf(expected, sizeof(expected), "%a", v);
+		} else {
+			snprintf(expected, sizeof(expected), "%.*a", precision, v);
+		}
+		std::string s = fmt("%.*a").f(v, -1, precision).str();
+		auto Input = [&](){
+			return fmt("bits %016lx, precision %d").lu(bits).d(precision).str();
+		};
+		mismatches.check(s, expected, Input);
+		double back = strformat_ns::misc::my_strtod(s.c_str(), nullptr);
+		if (precision < 0 && memcmp(&back, &v, 8) != 0) {
+			lossy.fail(Input(), fmt("%a").f(back).str(), s);
+		}
+		if (strtod(s.c_str(), nullptr) != back) {
+			mismatches.fail(Input() + ", parsing " + s, fmt("%a").f(back).str(), fmt("%a").f(strtod(s.c_str(), nullptr)).str());
+		}
+	}
+	TEST_MISMATCHES(mismatches);
+	TEST_MISMATCHES(lossy);
+}
+#endif